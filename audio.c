@@ -15,14 +15,18 @@
 #include <math.h>
 #include <stdbool.h>
 #include <string.h>
-
-#include <jack/jack.h>
-#include <jack/midiport.h>
+#include <ctype.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "audiostudio.h"
 
-#define JACK_CLIENT_NAME "Audio Studio"
-
 ///////////////////////////////////////////////////////////////////////////////
 // DECLARATIONS
 ///////////////////////////////////////////////////////////////////////////////
@@ -36,33 +40,157 @@ typedef struct {
   double feedback;
 } delay_line_t;
 
+typedef struct {
+  delay_line_t *delay[7];
+} reverb_t;
+
 delay_line_t *make_delay_line(int length, double feedback);
+reverb_t *make_reverb(void);
 void start_audio(void);
 void deinit_audio(void);
 void process_audio_synth(Instrument *inst, int nframes, const void **inputs, void **outputs);
 void process_audio_io_device(Instrument *inst, int nframes, const void **inputs, void **outputs);
 void process_audio_chorus(Instrument *inst, int nframes, const void **inputs, void **outputs);
 void recalculate_audio_graph(void);
+void receive_midi(void);
+void sequencer_process(int nframes);
+void compile_tempo_map(void);
+extern bool tempo_map_pending;
+extern double sample_rate;
 
-jack_port_t *input_port[2];
-int input_port_count;
-jack_port_t *input_port_midi;
-jack_port_t *output_port_1;
-jack_port_t *output_port_2;
-jack_client_t *client;
+extern AudioBackend jack_backend;
+extern AudioBackend null_backend;
 
 extern char gui_keyboard_state[256];
 extern Rack the_rack;
 void redisplay(void);
 
-double bpm = 120.0;
+double bpm = 120.0; /* at the song position, written by the audio thread */
 double seq_time = 0.0;
 bool recording = false;
 bool playing = false;
-double last_process;
+atomic_bool recording_overflow; /* a recorded note didn't fit, reported by the GUI */
+atomic_bool tracks_held; /* the GUI is replacing the tracks, see hold_tracks */
+atomic_bool tracks_in_use; /* a block is reading them */
+bool seq_tracks_held; /* audio thread, tracks_held for the current block */
 
 Sequencer sequencer_data;
 
+///////////////////////////////////////////////////////////////////////////////
+// Parameters
+///////////////////////////////////////////////////////////////////////////////
+
+/* Single producer single consumer ring, capacity is a power of two. Head and
+ * tail run freely and are only written by their own side. */
+typedef struct {
+  char *data;
+  int elem_size;
+  unsigned int mask;
+  atomic_uint head; /* producer */
+  atomic_uint tail; /* consumer */
+} spsc_queue;
+
+bool spsc_push(spsc_queue *q, const void *elem)
+{
+  unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+  if (head - tail > q->mask)
+    return false; /* full */
+
+  memcpy(q->data + (head & q->mask) * q->elem_size, elem, q->elem_size);
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+  return true;
+}
+
+bool spsc_pop(spsc_queue *q, void *elem)
+{
+  unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+  if (head == tail)
+    return false;
+
+  memcpy(elem, q->data + (tail & q->mask) * q->elem_size, q->elem_size);
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+  return true;
+}
+
+#define PARAM_RAMP_TIME 0.01 /* seconds */
+
+typedef struct {
+  Instrument *inst;
+  int index;
+  double value;
+} ParamChange;
+
+ParamChange param_queue_data[1024];
+spsc_queue param_queue = { (char *)param_queue_data, sizeof(ParamChange), ARRAY_SIZE(param_queue_data) - 1 };
+
+void init_param(Param *p, double value, bool smooth)
+{
+  p->value = value;
+  p->target = value;
+  p->step = 0.0;
+  p->ramp_frames = 0;
+  p->smooth = smooth;
+}
+
+/* called from the GUI thread */
+void send_param(Instrument *inst, int index, double value)
+{
+  ParamChange change = { inst, index, value };
+
+  if (!spsc_push(&param_queue, &change))
+    printf("Parameter queue full\n");
+}
+
+/* called by the audio thread at the start of a block */
+void receive_params(void)
+{
+  ParamChange change;
+
+  while (spsc_pop(&param_queue, &change))
+  {
+    Param *p = &change.inst->params[change.index];
+
+    p->target = change.value;
+    p->ramp_frames = p->smooth ? (int)(PARAM_RAMP_TIME * sample_rate) : 0;
+    if (p->ramp_frames > 0)
+      p->step = (p->target - p->value) / p->ramp_frames;
+    else
+      p->value = p->target;
+  }
+}
+
+/* value for the next sample */
+static inline double param_next(Param *p)
+{
+  if (p->ramp_frames > 0)
+  {
+    p->value = --p->ramp_frames > 0 ? p->value + p->step : p->target;
+  }
+
+  return p->value;
+}
+
+/* value for the whole block, for parameters too costly to follow per sample */
+static inline double param_block(Param *p, int nframes)
+{
+  double value = p->value;
+
+  if (p->ramp_frames > 0)
+  {
+    int n = MIN(nframes, p->ramp_frames);
+    p->ramp_frames -= n;
+    p->value = p->ramp_frames > 0 ? p->value + n * p->step : p->target;
+  }
+
+  return value;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Audio engine
 ///////////////////////////////////////////////////////////////////////////////
@@ -76,397 +204,2317 @@ enum {
 };
 
 int audio_thread_state = ATS_STARTUP;
-int wakeup_audio_thread;
+
+/* posted from the process callback, sem_post is async-signal-safe and never blocks */
+sem_t audio_thread_wakeup;
+
+/* false: the audio thread renders the next block while the backend plays
+ * the previous one (one extra period of latency). true: render synchronously
+ * inside the backend process callback straight into its output buffers. */
+bool audio_render_in_callback = false;
 
 double *main_output_buffer[2];
 double *main_input_buffer[2];
-double *temp_buffers[10];
+float *main_output_port[2]; /* set only while rendering in the callback */
 double *empty_buffer;
 int main_frames;
+atomic_uint_fast64_t audio_block_count; /* blocks started by process_audio */
 
-int num_buffers = 1024;
-double *big_buffer;
-int *free_buffers;
-int free_buffers_count;
+double sample_rate = 48000.0f;
 
-sample_t *allocate_buffer(void)
+double *allocate_double(int n)
 {
-  if (free_buffers_count > 0)
-  {
-    free_buffers_count--;
-    int idx = free_buffers[free_buffers_count];
-
-    return &big_buffer[idx * main_frames];
-  }
-  else
-  {
-    printf("No buffers\n");
-
-    return NULL;
-  }
+  return (double *)calloc(n, sizeof(double));
 }
 
-double sample_rate = 48000.0f;
+///////////////////////////////////////////////////////////////////////////////
+// Tuning
+///////////////////////////////////////////////////////////////////////////////
 
-delay_line_t *delay1[10];
+/* Frequencies of the 128 keys, double buffered like the tempo map: a new
+ * tuning is built into the spare table and published with a pointer swap.
+ * The serial tells the synth to refresh its cached increments. */
+double tuning_tables[2][128];
+_Atomic(double *) key_frequencies;
+atomic_uint tuning_serial;
 
-double *allocate_double(int n)
+static void publish_tuning(double *table)
 {
-  return (double *)calloc(n, sizeof(double));
+  atomic_store_explicit(&key_frequencies, table, memory_order_release);
+  atomic_fetch_add(&tuning_serial, 1);
 }
 
-double key_to_frequency(int key)
+static double *spare_tuning_table(void)
+{
+  return atomic_load(&key_frequencies) == tuning_tables[0] ? tuning_tables[1] : tuning_tables[0];
+}
+
+void set_equal_temperament(void)
 {
+  double *table = spare_tuning_table();
+
   /* note 0 = C0 */
   /* note 9 + 5 * 12 = A4 - 440 Hz */
-  return 440.0f * powf(2.0f, (key - (9 + 5 * 12)) / 12.0);
-}
+  for (int key = 0; key < 128; key++)
+    table[key] = 440.0f * powf(2.0f, (key - (9 + 5 * 12)) / 12.0);
 
-#define WAVEFORM_LENGTH 256
-#define WAVEFORM_FIXED_MULTIPLIER 65536.0
-double saw_shape[WAVEFORM_LENGTH];
-double square_shape[WAVEFORM_LENGTH];
-double triangle_shape[WAVEFORM_LENGTH];
-double sine_shape[WAVEFORM_LENGTH];
+  publish_tuning(table);
+}
 
-double *get_waveform(int type)
+void init_tuning(void)
 {
-  switch (type)
-  {
-    case 0: return saw_shape;
-    case 1: return square_shape;
-    case 2: return triangle_shape;
-    default:
-    case 3: return sine_shape;
-  }
+  if (!atomic_load(&key_frequencies))
+    set_equal_temperament();
 }
 
-void init_waveforms(void)
+double key_to_frequency(int key)
 {
-    for (int i = 0; i < WAVEFORM_LENGTH; i++)
-    {
-        saw_shape[i] = -1.0 + 2.0 * ((double)i / (WAVEFORM_LENGTH - 1));
-        square_shape[i] = -1.0 + (i > (WAVEFORM_LENGTH / 2) ? 2.0 : 0.0);
-        if ((i >= (WAVEFORM_LENGTH / 4)) && (i < 3 * (WAVEFORM_LENGTH / 4)))
-          triangle_shape[i] = 2.0 - 4.0 * ((double)i / (WAVEFORM_LENGTH - 1));
-        else if (i >= 3 * (WAVEFORM_LENGTH / 4))
-          triangle_shape[i] = -4.0 +  4.0 * ((double)i / (WAVEFORM_LENGTH - 1));
-        else
-          triangle_shape[i] = 4.0 * ((double)i / (WAVEFORM_LENGTH - 1));
-        sine_shape[i] = sin(2.0 * M_PI * (double)i / (WAVEFORM_LENGTH - 1));
-    }
+  return atomic_load_explicit(&key_frequencies, memory_order_acquire)[key & 127];
 }
 
-/* phase is in 16.16 fixed point format */
-static inline double interp_waveform(double *data, uint32_t mask, uint32_t phase)
+/* next line that isn't a comment, NULL at the end */
+static char *scala_line(FILE *f, char *line, int size)
 {
-  static const double fraction = 1 / WAVEFORM_FIXED_MULTIPLIER;
-    uint32_t pos_0 = phase >> 16;
-    double off = fraction * (phase & 0xffff);
+  while (fgets(line, size, f))
+  {
+    if (line[0] != '!')
+      return line;
+  }
 
-    return (1.0 - off) * data[pos_0 & mask] + off * data[(pos_0 + 1) & mask];
+  return NULL;
 }
 
-void allocate_main_buffers(int nframes)
+/* a pitch in cents, or a ratio, or a whole number */
+static bool parse_scala_pitch(const char *line, double *cents)
 {
-  main_frames = nframes;
-  for (int i = 0; i < ARRAY_SIZE(main_output_buffer); i++)
-  {
-    FREE_IF_NOT_NULL(main_output_buffer[i]);
-    main_output_buffer[i] = allocate_double(main_frames);
-  }
-  for (int i = 0; i < ARRAY_SIZE(main_input_buffer); i++)
+  while (isspace((unsigned char)*line))
+    line++;
+
+  char *end;
+  const char *space = strpbrk(line, " \t\r\n");
+  const char *dot = strchr(line, '.');
+  if (dot && (!space || dot < space))
   {
-    FREE_IF_NOT_NULL(main_input_buffer[i]);
-    main_input_buffer[i] = allocate_double(main_frames);
+    *cents = strtod(line, &end);
+    return end != line;
   }
 
-  for (int i = 0; i < ARRAY_SIZE(temp_buffers); i++)
+  long num = strtol(line, &end, 10);
+  long den = 1;
+  if (end == line || num <= 0)
+    return false;
+  if (*end == '/')
   {
-    FREE_IF_NOT_NULL(temp_buffers[i]);
-    temp_buffers[i] = allocate_double(main_frames);
+    const char *den_start = end + 1;
+    den = strtol(den_start, &end, 10);
+    if (end == den_start || den <= 0)
+      return false;
   }
 
-  FREE_IF_NOT_NULL(empty_buffer);
-  empty_buffer = allocate_double(main_frames);
-
-  FREE_IF_NOT_NULL(big_buffer);
-  big_buffer = allocate_double(main_frames * num_buffers);
-  FREE_IF_NOT_NULL(free_buffers);
-  free_buffers = malloc(sizeof(int) * num_buffers);
-  free_buffers_count = num_buffers;
-  for (int i = 0; i < num_buffers; i++)
-    free_buffers[num_buffers - i - 1] = i;
+  *cents = 1200.0 * log2((double)num / den);
+  return true;
 }
 
-typedef struct adsr_ {
-    double attack;
-    double decay;
-    double sustain;
-    double release;
-} adsr;
+static int floor_div(int a, int b)
+{
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
 
-typedef struct adsr_state_ {
-    bool note_off;
-    double note_off_value;
-    double note_off_time;
-} adsr_state;
+/* degree 0 is at 0 cents, the last pitch of the scale is the period */
+static double degree_cents(int degree, const double *scale, int count)
+{
+  int period = floor_div(degree, count);
+  int step = degree - period * count;
+  return period * scale[count - 1] + (step > 0 ? scale[step - 1] : 0.0);
+}
 
-double get_adsr(adsr *o, adsr_state *env_state, double time, int *finished)
+/* Scala scale (.scl) with an optional keyboard mapping (.kbm). Without a
+ * mapping degree 0 is on key 60 and key 69 is 440 Hz. */
+bool load_tuning(const char *scl_filename, const char *kbm_filename)
 {
-    if (env_state->note_off == false)
+  char line[512];
+  double scale[1024]; /* cents of degrees 1..count, the last is the period */
+  int count;
+
+  FILE *f = fopen(scl_filename, "r");
+  if (!f)
+  {
+    fprintf(stderr, "Can't open scale \"%s\"\n", scl_filename);
+    return false;
+  }
+
+  bool ok = scala_line(f, line, sizeof(line)) /* description */ &&
+    scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &count) == 1 && count > 0 && count <= (int)ARRAY_SIZE(scale);
+  for (int i = 0; ok && i < count; i++)
+    ok = scala_line(f, line, sizeof(line)) && parse_scala_pitch(line, &scale[i]);
+  fclose(f);
+
+  if (!ok)
+  {
+    fprintf(stderr, "Invalid scale \"%s\"\n", scl_filename);
+    return false;
+  }
+
+  int map_size = 0, first_key = 0, last_key = 127, middle_key = 60, reference_key = 69, octave_degree = count;
+  double reference_frequency = 440.0;
+  int map[128]; /* degree, -1 unmapped */
+
+  if (kbm_filename)
+  {
+    f = fopen(kbm_filename, "r");
+    if (!f)
     {
-        if (time <= o->attack)
-        {
-            return time / o->attack; /* 0 -> 1 */
-        }
-        else if (time <= (o->attack + o->decay))
-        {
-            double rel_time = (time - o->attack) / o->decay; /* 0 -> 1 */
+      fprintf(stderr, "Can't open keyboard mapping \"%s\"\n", kbm_filename);
+      return false;
+    }
 
-            return o->sustain + (1 - o->sustain) * (1 - rel_time);
-        }
-        else
-        {
-            return o->sustain;
-        }
+    ok = scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &map_size) == 1 && map_size >= 0 && map_size <= (int)ARRAY_SIZE(map) &&
+      scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &first_key) == 1 &&
+      scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &last_key) == 1 &&
+      scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &middle_key) == 1 &&
+      scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &reference_key) == 1 &&
+      scala_line(f, line, sizeof(line)) && sscanf(line, "%lf", &reference_frequency) == 1 && reference_frequency > 0.0 &&
+      scala_line(f, line, sizeof(line)) && sscanf(line, "%d", &octave_degree) == 1 && octave_degree >= 0;
+    for (int i = 0; ok && i < map_size; i++)
+    {
+      ok = scala_line(f, line, sizeof(line));
+      if (ok && sscanf(line, "%d", &map[i]) != 1)
+        map[i] = -1; /* x */
     }
-    else
+    fclose(f);
+
+    if (!ok)
     {
-        double rel_time = (time - env_state->note_off_time) / o->release;
-        if (rel_time > 1.0)
-        {
-            if (finished)
-                *finished = 1;
-            return 0.0;
-        }
+      fprintf(stderr, "Invalid keyboard mapping \"%s\"\n", kbm_filename);
+      return false;
+    }
+    if (octave_degree == 0)
+      octave_degree = map_size > 0 ? count : 0;
+  }
 
-        return env_state->note_off_value * (1.0 - rel_time);
+  /* cents of every key from the middle key, NAN for unmapped keys */
+  double cents[128];
+  for (int key = 0; key < 128; key++)
+  {
+    int offset = key - middle_key;
+    int degree = offset;
+    cents[key] = NAN;
+
+    if (map_size > 0)
+    {
+      int index = offset - floor_div(offset, map_size) * map_size;
+      if (map[index] < 0)
+        continue;
+      degree = floor_div(offset, map_size) * octave_degree + map[index];
     }
-}
 
-int audio_buffer_size_callback(jack_nframes_t nframes, void *arg)
-{
-  printf("Buffer size set to %d\n", (int)nframes);
-  if (nframes > 0)
+    cents[key] = degree_cents(degree, scale, count);
+  }
+
+  /* the reference key sets the pitch even when it's unmapped or off the
+   * keyboard, then it takes the degree of its place in the mapping */
+  int reference_offset = reference_key - middle_key;
+  int reference_degree = reference_offset;
+  if (map_size > 0)
   {
-    allocate_main_buffers((int)nframes);
+    int index = reference_offset - floor_div(reference_offset, map_size) * map_size;
+    reference_degree = floor_div(reference_offset, map_size) * octave_degree + (map[index] >= 0 ? map[index] : index);
   }
-}
+  double reference_cents = degree_cents(reference_degree, scale, count);
 
-void process_audio_synth(Instrument *inst, int nframes, const void **inputs, void **outputs);
+  /* unmapped keys and keys outside the mapping are silent */
+  double *table = spare_tuning_table();
+  for (int key = 0; key < 128; key++)
+  {
+    if (key < first_key || key > last_key || isnan(cents[key]))
+      table[key] = 0.0;
+    else
+      table[key] = reference_frequency * exp2((cents[key] - reference_cents) / 1200.0);
+  }
 
-void process_audio_io_device(Instrument *inst, int nframes, const void **inputs, void **outputs)
-{
-  double *input_l = (double *)inputs[0];
-  double *input_r = (double *)inputs[1];
+  publish_tuning(table);
+  printf("Tuning: %d notes per period of %.2f cents from \"%s\"\n", count, scale[count - 1], scl_filename);
 
-  double volume = inst->sliders[0].value;
+  return true;
+}
 
-  double *output_l = main_output_buffer[0];
-  double *output_r = main_output_buffer[1];
+#define WAVEFORM_LENGTH 2048
+#define WAVEFORM_FIXED_MULTIPLIER 65536.0
+/* Band-limited tables per octave: level l holds the harmonics up to
+ * (WAVEFORM_LENGTH / 2) >> l and the last level is silent. */
+#define WAVEFORM_MIP_LEVELS 12
+#define WAVEFORM_SHAPES 4
+double waveforms[WAVEFORM_SHAPES][WAVEFORM_MIP_LEVELS][WAVEFORM_LENGTH];
 
-  while (nframes--)
-  {
-    output_l[0] = volume * input_l[0];
-    output_r[0] = volume * input_r[0];
+const double *get_waveform(int type, int level)
+{
+  if (type < 0 || type >= WAVEFORM_SHAPES)
+    type = 3;
+  return waveforms[type][level];
+}
 
-    input_l += 1;
-    input_r += 1;
+/* lowest level without harmonics above Nyquist for the phase increment */
+int waveform_mip_level(uint32_t phase_delta)
+{
+  int level = 0;
+  while (level < WAVEFORM_MIP_LEVELS - 1 && phase_delta > ((uint32_t)WAVEFORM_FIXED_MULTIPLIER << level))
+    level++;
+  return level;
+}
 
-    output_l += 1;
-    output_r += 1;
+/* Fourier series of saw, square, triangle and sine, in the phase of the
+ * naive shapes */
+static double harmonic_amplitude(int type, int k)
+{
+  switch (type)
+  {
+    case 0: return -2.0 / (M_PI * k);
+    case 1: return (k & 1) ? -4.0 / (M_PI * k) : 0.0;
+    case 2: return (k & 1) ? ((k & 2) ? -8.0 : 8.0) / (M_PI * M_PI * k * k) : 0.0;
+    default: return k == 1 ? 1.0 : 0.0;
   }
 }
 
-void process_reverb(double *input_l, double *input_r, double *output_l, double *output_r, int nframes, double mix);
-
-void process_audio_chorus(Instrument *inst, int nframes, const void **inputs, void **outputs)
+/* additive synthesis from the top level down, each level adds the
+ * harmonics of its octave to the one above */
+void init_waveforms(void)
 {
-  double *input_l = (double *)inputs[0];
-  double *input_r = (double *)inputs[1];
+  static double sine[WAVEFORM_LENGTH];
+  double sum[WAVEFORM_LENGTH];
 
-  double *output_l = (double *)outputs[0];
-  double *output_r = (double *)outputs[1];
+  for (int i = 0; i < WAVEFORM_LENGTH; i++)
+    sine[i] = sin(2.0 * M_PI * (double)i / WAVEFORM_LENGTH);
 
-  process_reverb(input_l, input_r, output_l, output_r, nframes, inst->sliders[2].value);
-#if 0
-  while (nframes--)
+  for (int type = 0; type < WAVEFORM_SHAPES; type++)
   {
-    output_l[0] = input_l[0];
-    output_r[0] = input_r[0];
+    int harmonics = 0;
+    memset(sum, 0, sizeof(sum));
+    memset(waveforms[type][WAVEFORM_MIP_LEVELS - 1], 0, sizeof(sum));
+
+    for (int level = WAVEFORM_MIP_LEVELS - 2; level >= 0; level--)
+    {
+      int top = MIN((WAVEFORM_LENGTH / 2) >> level, WAVEFORM_LENGTH / 2 - 1);
+      for (int k = harmonics + 1; k <= top; k++)
+      {
+        double amplitude = harmonic_amplitude(type, k);
+        if (amplitude == 0.0)
+          continue;
+        for (int i = 0; i < WAVEFORM_LENGTH; i++)
+          sum[i] += amplitude * sine[(k * i) & (WAVEFORM_LENGTH - 1)];
+      }
+      harmonics = top;
+      memcpy(waveforms[type][level], sum, sizeof(sum));
+    }
+  }
+}
 
+/* phase is in 16.16 fixed point format */
+static inline double interp_waveform(const double *data, uint32_t mask, uint32_t phase)
+{
+  static const double fraction = 1 / WAVEFORM_FIXED_MULTIPLIER;
+    uint32_t pos_0 = phase >> 16;
+    double off = fraction * (phase & 0xffff);
 
+    return (1.0 - off) * data[pos_0 & mask] + off * data[(pos_0 + 1) & mask];
+}
 
-    input_l += 1;
-    input_r += 1;
-    output_l += 1;
-    output_r += 1;
+///////////////////////////////////////////////////////////////////////////////
+// Oscillator kernels
+///////////////////////////////////////////////////////////////////////////////
+
+/* Add count oscillators reading one table to out and advance their phases.
+ * An oscillator's phase over the frames is phase + n * delta, so the vector
+ * kernels run on consecutive frames and pay off with a single unison voice.
+ * All kernels do the same arithmetic as interp_waveform and give identical
+ * results. */
+typedef void (*OscillatorKernel)(const double *table, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes);
+
+void render_oscillators_scalar(const double *table, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes)
+{
+  for (int j = 0; j < count; j++)
+  {
+    uint32_t p = phase[j];
+    for (int n = 0; n < nframes; n++)
+    {
+      out[n] += interp_waveform(table, WAVEFORM_LENGTH - 1, p);
+      p += delta[j];
+    }
+    phase[j] = p;
   }
-#endif
 }
 
-Instrument *process_sequence_a[256];
-Instrument *process_sequence_b[256];
-Instrument **process_sequence = &process_sequence_a[0];
-
-void recalculate_audio_graph(void)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void render_oscillators_sse2(const double *table, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes)
 {
-  Instrument *root = the_rack.first;
+  const __m128d fraction = _mm_set1_pd(1 / WAVEFORM_FIXED_MULTIPLIER);
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128i mask = _mm_set1_epi32(WAVEFORM_LENGTH - 1);
+  const __m128i low = _mm_set1_epi32(0xffff);
+  const int mask_scalar = WAVEFORM_LENGTH - 1;
 
-  Instrument **process_sequence_new = (process_sequence == &process_sequence_a[0]) ? &process_sequence_b[0] : &process_sequence_a[0];
+  for (int j = 0; j < count; j++)
+  {
+    uint32_t p = phase[j];
+    uint32_t d = delta[j];
+    __m128i ph = _mm_setr_epi32(p, p + d, p + 2 * d, p + 3 * d);
+    const __m128i step = _mm_set1_epi32(4 * d);
 
-  memset(process_sequence_new, 0, sizeof(Instrument *) * 256);
-  int count = 0;
+    int n = 0;
+    for (; n + 4 <= nframes; n += 4)
+    {
+      /* no gather, the indices go through general registers */
+      __m128i pos = _mm_and_si128(_mm_srli_epi32(ph, 16), mask);
+      int i0 = _mm_cvtsi128_si32(pos);
+      int i1 = _mm_cvtsi128_si32(_mm_srli_si128(pos, 4));
+      int i2 = _mm_cvtsi128_si32(_mm_srli_si128(pos, 8));
+      int i3 = _mm_cvtsi128_si32(_mm_srli_si128(pos, 12));
+
+      __m128i frac = _mm_and_si128(ph, low);
+      __m128d off_lo = _mm_mul_pd(fraction, _mm_cvtepi32_pd(frac));
+      __m128d off_hi = _mm_mul_pd(fraction, _mm_cvtepi32_pd(_mm_srli_si128(frac, 8)));
+
+      __m128d v_lo = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(one, off_lo), _mm_setr_pd(table[i0], table[i1])),
+          _mm_mul_pd(off_lo, _mm_setr_pd(table[(i0 + 1) & mask_scalar], table[(i1 + 1) & mask_scalar])));
+      __m128d v_hi = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(one, off_hi), _mm_setr_pd(table[i2], table[i3])),
+          _mm_mul_pd(off_hi, _mm_setr_pd(table[(i2 + 1) & mask_scalar], table[(i3 + 1) & mask_scalar])));
+
+      _mm_storeu_pd(out + n, _mm_add_pd(_mm_loadu_pd(out + n), v_lo));
+      _mm_storeu_pd(out + n + 2, _mm_add_pd(_mm_loadu_pd(out + n + 2), v_hi));
+      ph = _mm_add_epi32(ph, step);
+    }
 
-  Instrument *stack[1024];
-  int stack_pos = 0;
+    p += n * d;
+    for (; n < nframes; n++)
+    {
+      out[n] += interp_waveform(table, WAVEFORM_LENGTH - 1, p);
+      p += d;
+    }
+    phase[j] = p;
+  }
+}
 
-  stack[0] = root;
-  stack_pos = 1;
-  process_sequence_new[count++] = root;
+/* no FMA, it would round differently from the scalar kernel */
+__attribute__((target("avx2")))
+void render_oscillators_avx2(const double *table, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes)
+{
+  const __m256d fraction = _mm256_set1_pd(1 / WAVEFORM_FIXED_MULTIPLIER);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m128i mask = _mm_set1_epi32(WAVEFORM_LENGTH - 1);
+  const __m128i low = _mm_set1_epi32(0xffff);
 
-  while (stack_pos > 0)
+  for (int j = 0; j < count; j++)
   {
-    Instrument *current = stack[stack_pos - 1];
-    stack_pos--;
+    uint32_t p = phase[j];
+    uint32_t d = delta[j];
+    __m128i ph = _mm_setr_epi32(p, p + d, p + 2 * d, p + 3 * d);
+    const __m128i step = _mm_set1_epi32(4 * d);
 
-    for (int i = 0; i < current->num_inputs; i++)
+    int n = 0;
+    for (; n + 4 <= nframes; n += 4)
     {
-      Instrument *inst = current->inputs[i].target_inst;
-      if (inst)
-      {
-        bool found = false;
-        for (int j = 0; j < count; j++)
-        {
-          if (process_sequence_new[j] == inst)
-          {
-            /* this instrument is already processed - move it to later (earlier) position */
-            memmove(&process_sequence_new[j], &process_sequence_new[j + 1], (count - (j + 1)) * sizeof(Instrument *));
-            count--;
-            break;
-          }
-        }
-        process_sequence_new[count++] = inst;
+      __m128i pos = _mm_srli_epi32(ph, 16);
+      __m256d a = _mm256_i32gather_pd(table, _mm_and_si128(pos, mask), 8);
+      __m256d b = _mm256_i32gather_pd(table, _mm_and_si128(_mm_add_epi32(pos, _mm_set1_epi32(1)), mask), 8);
+      __m256d off = _mm256_mul_pd(fraction, _mm256_cvtepi32_pd(_mm_and_si128(ph, low)));
+
+      __m256d v = _mm256_add_pd(_mm256_mul_pd(_mm256_sub_pd(one, off), a), _mm256_mul_pd(off, b));
+      _mm256_storeu_pd(out + n, _mm256_add_pd(_mm256_loadu_pd(out + n), v));
+      ph = _mm_add_epi32(ph, step);
+    }
 
-        stack[stack_pos++] = inst;
-      }
+    p += n * d;
+    for (; n < nframes; n++)
+    {
+      out[n] += interp_waveform(table, WAVEFORM_LENGTH - 1, p);
+      p += d;
     }
+    phase[j] = p;
   }
+}
+#endif
 
-  /* switch atomically */
-  process_sequence = process_sequence_new;
+/* PolyBLEP oscillators compute the shapes from the phase and smooth each
+ * step (and PolyBLAMP each corner of the triangle) over the sample either
+ * side, with no table to read. They use the same phase and increments as
+ * the wavetables, a period being BLEP_PERIOD of the 32 bit phase. */
+enum { BLEP_SAW = 0, BLEP_SQUARE, BLEP_TRIANGLE };
+#define SYNTH_SHAPE_BLEP 4 /* synth shape of BLEP_SAW, the ones before are wavetables */
+#define BLEP_PERIOD (WAVEFORM_LENGTH * WAVEFORM_FIXED_MULTIPLIER)
+
+typedef void (*BlepKernel)(int shape, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes);
+
+static inline double poly_blep(double t, double dt, double inv_dt)
+{
+  if (t < dt)
+  {
+    double x = t * inv_dt;
+    return x + x - x * x - 1.0;
+  }
+  if (t > 1.0 - dt)
+  {
+    double x = (t - 1.0) * inv_dt;
+    return x * x + x + x + 1.0;
+  }
+  return 0.0;
 }
 
-void process_audio(void)
+/* dt_6 is dt / 6 */
+static inline double poly_blamp(double t, double dt, double inv_dt, double dt_6)
 {
-  Instrument **current_seq = process_sequence;
+  if (t < dt)
+  {
+    double y = 1.0 - t * inv_dt;
+    return y * y * y * dt_6;
+  }
+  if (t > 1.0 - dt)
+  {
+    double y = 1.0 + (t - 1.0) * inv_dt;
+    return y * y * y * dt_6;
+  }
+  return 0.0;
+}
 
-  int count = 0;
-  while (current_seq[count])
-    count++;
-    
-  double *tmp[2];
-  tmp[0] = temp_buffers[0];
-  tmp[1] = temp_buffers[1];
+static inline double wrap_phase(double t)
+{
+  return t >= 1.0 ? t - 1.0 : t;
+}
 
-  double *inputs[64];
-  double *outputs[64];
+/* t in [0, 1), in the phase of the wavetable shapes */
+static inline double blep_oscillator(int shape, double t, double dt, double inv_dt, double dt_6)
+{
+  switch (shape)
+  {
+    default:
+    case BLEP_SAW:
+      return (t + t - 1.0) - poly_blep(t, dt, inv_dt);
+    case BLEP_SQUARE:
+      return (t < 0.5 ? -1.0 : 1.0) + poly_blep(wrap_phase(t + 0.5), dt, inv_dt) - poly_blep(t, dt, inv_dt);
+    case BLEP_TRIANGLE:
+      return (4.0 * fabs(wrap_phase(t + 0.75) - 0.5) - 1.0) +
+        8.0 * (poly_blamp(wrap_phase(t + 0.25), dt, inv_dt, dt_6) - poly_blamp(wrap_phase(t + 0.75), dt, inv_dt, dt_6));
+  }
+}
+
+void render_blep_scalar(int shape, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes)
+{
+  for (int j = 0; j < count; j++)
+  {
+    uint32_t p = phase[j];
+    uint32_t d = delta[j];
+    double dt = d * (1.0 / BLEP_PERIOD);
+    double inv_dt = 1.0 / dt;
+    double dt_6 = dt / 6.0;
+
+    for (int n = 0; n < nframes; n++)
+    {
+      double t = (p & ((uint32_t)BLEP_PERIOD - 1)) * (1.0 / BLEP_PERIOD);
+      out[n] += blep_oscillator(shape, t, dt, inv_dt, dt_6);
+      p += d;
+    }
+    phase[j] = p;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* the scalar code branch for branch, both sides computed and blended */
+__attribute__((target("avx2")))
+static inline __m256d poly_blep_avx2(__m256d t, __m256d dt, __m256d inv_dt)
+{
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d x = _mm256_mul_pd(t, inv_dt);
+  __m256d start = _mm256_sub_pd(_mm256_sub_pd(_mm256_add_pd(x, x), _mm256_mul_pd(x, x)), one);
+  __m256d y = _mm256_mul_pd(_mm256_sub_pd(t, one), inv_dt);
+  __m256d end = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(y, y), y), y), one);
+
+  __m256d r = _mm256_and_pd(_mm256_cmp_pd(t, _mm256_sub_pd(one, dt), _CMP_GT_OQ), end);
+  return _mm256_blendv_pd(r, start, _mm256_cmp_pd(t, dt, _CMP_LT_OQ));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d poly_blamp_avx2(__m256d t, __m256d dt, __m256d inv_dt, __m256d dt_6)
+{
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d x = _mm256_sub_pd(one, _mm256_mul_pd(t, inv_dt));
+  __m256d start = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(x, x), x), dt_6);
+  __m256d y = _mm256_add_pd(one, _mm256_mul_pd(_mm256_sub_pd(t, one), inv_dt));
+  __m256d end = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(y, y), y), dt_6);
+
+  __m256d r = _mm256_and_pd(_mm256_cmp_pd(t, _mm256_sub_pd(one, dt), _CMP_GT_OQ), end);
+  return _mm256_blendv_pd(r, start, _mm256_cmp_pd(t, dt, _CMP_LT_OQ));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d wrap_phase_avx2(__m256d t)
+{
+  const __m256d one = _mm256_set1_pd(1.0);
+  return _mm256_sub_pd(t, _mm256_and_pd(_mm256_cmp_pd(t, one, _CMP_GE_OQ), one));
+}
+
+/* four consecutive frames of an oscillator at a time, like the table
+ * kernels; no FMA so the results match render_blep_scalar */
+__attribute__((target("avx2")))
+void render_blep_avx2(int shape, uint32_t *phase, const uint32_t *delta, int count, double *out, int nframes)
+{
+  const __m256d period = _mm256_set1_pd(1.0 / BLEP_PERIOD);
+  const __m128i mask = _mm_set1_epi32((uint32_t)BLEP_PERIOD - 1);
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256d quarter = _mm256_set1_pd(0.25);
+  const __m256d three_quarters = _mm256_set1_pd(0.75);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+
+  for (int j = 0; j < count; j++)
+  {
+    uint32_t p = phase[j];
+    uint32_t d = delta[j];
+    double dt_scalar = d * (1.0 / BLEP_PERIOD);
+    double inv_dt_scalar = 1.0 / dt_scalar;
+    double dt_6_scalar = dt_scalar / 6.0;
+    __m256d dt = _mm256_set1_pd(dt_scalar);
+    __m256d inv_dt = _mm256_set1_pd(inv_dt_scalar);
+    __m256d dt_6 = _mm256_set1_pd(dt_6_scalar);
+    __m128i ph = _mm_setr_epi32(p, p + d, p + 2 * d, p + 3 * d);
+    const __m128i step = _mm_set1_epi32(4 * d);
+
+    int n = 0;
+    for (; n + 4 <= nframes; n += 4)
+    {
+      __m256d t = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm_and_si128(ph, mask)), period);
+      __m256d v;
+
+      switch (shape)
+      {
+        default:
+        case BLEP_SAW:
+          v = _mm256_sub_pd(_mm256_sub_pd(_mm256_add_pd(t, t), one), poly_blep_avx2(t, dt, inv_dt));
+          break;
+        case BLEP_SQUARE:
+          v = _mm256_blendv_pd(one, _mm256_set1_pd(-1.0), _mm256_cmp_pd(t, half, _CMP_LT_OQ));
+          v = _mm256_sub_pd(_mm256_add_pd(v, poly_blep_avx2(wrap_phase_avx2(_mm256_add_pd(t, half)), dt, inv_dt)),
+              poly_blep_avx2(t, dt, inv_dt));
+          break;
+        case BLEP_TRIANGLE:
+          v = _mm256_andnot_pd(sign, _mm256_sub_pd(wrap_phase_avx2(_mm256_add_pd(t, three_quarters)), half));
+          v = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), v), one);
+          v = _mm256_add_pd(v, _mm256_mul_pd(_mm256_set1_pd(8.0),
+                _mm256_sub_pd(poly_blamp_avx2(wrap_phase_avx2(_mm256_add_pd(t, quarter)), dt, inv_dt, dt_6),
+                  poly_blamp_avx2(wrap_phase_avx2(_mm256_add_pd(t, three_quarters)), dt, inv_dt, dt_6))));
+          break;
+      }
+
+      _mm256_storeu_pd(out + n, _mm256_add_pd(_mm256_loadu_pd(out + n), v));
+      ph = _mm_add_epi32(ph, step);
+    }
+
+    p += n * d;
+    for (; n < nframes; n++)
+    {
+      double t = (p & ((uint32_t)BLEP_PERIOD - 1)) * (1.0 / BLEP_PERIOD);
+      out[n] += blep_oscillator(shape, t, dt_scalar, inv_dt_scalar, dt_6_scalar);
+      p += d;
+    }
+    phase[j] = p;
+  }
+}
+#endif
+
+/* Trapezoidal state variable low pass of each voice, one voice per lane.
+ * buffer holds the voices' input frame by frame, MAX_SYNTH_POLYPHONY
+ * apart, and gets the output; voices is a multiple of 4 and the padding
+ * voices have silent input and state. */
+typedef void (*VoiceFilterKernel)(double *ic1, double *ic2, const double *a1, const double *a2, const double *a3, double (*buffer)[MAX_SYNTH_POLYPHONY], int voices, int nframes);
+
+void filter_voices_scalar(double *ic1, double *ic2, const double *a1, const double *a2, const double *a3, double (*buffer)[MAX_SYNTH_POLYPHONY], int voices, int nframes)
+{
+  /* voices inner, their recursions are independent */
+  for (int n = 0; n < nframes; n++)
+  {
+    for (int k = 0; k < voices; k++)
+    {
+      double v3 = buffer[n][k] - ic2[k];
+      double v1 = a1[k] * ic1[k] + a2[k] * v3;
+      double v2 = ic2[k] + a2[k] * ic1[k] + a3[k] * v3;
+      ic1[k] = 2.0 * v1 - ic1[k];
+      ic2[k] = 2.0 * v2 - ic2[k];
+      buffer[n][k] = v2;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* no FMA, like the oscillator kernels */
+__attribute__((target("avx2")))
+void filter_voices_avx2(double *ic1, double *ic2, const double *a1, const double *a2, const double *a3, double (*buffer)[MAX_SYNTH_POLYPHONY], int voices, int nframes)
+{
+  const __m256d two = _mm256_set1_pd(2.0);
+
+  /* voices inner like the scalar kernel, the state stays in ic1 and ic2 */
+  for (int n = 0; n < nframes; n++)
+  {
+    for (int k = 0; k < voices; k += 4)
+    {
+      __m256d s1 = _mm256_loadu_pd(ic1 + k);
+      __m256d s2 = _mm256_loadu_pd(ic2 + k);
+      __m256d c2 = _mm256_loadu_pd(a2 + k);
+      __m256d v3 = _mm256_sub_pd(_mm256_loadu_pd(&buffer[n][k]), s2);
+      __m256d v1 = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(a1 + k), s1), _mm256_mul_pd(c2, v3));
+      __m256d v2 = _mm256_add_pd(_mm256_add_pd(s2, _mm256_mul_pd(c2, s1)), _mm256_mul_pd(_mm256_loadu_pd(a3 + k), v3));
+      _mm256_storeu_pd(ic1 + k, _mm256_sub_pd(_mm256_mul_pd(two, v1), s1));
+      _mm256_storeu_pd(ic2 + k, _mm256_sub_pd(_mm256_mul_pd(two, v2), s2));
+      _mm256_storeu_pd(&buffer[n][k], v2);
+    }
+  }
+}
+#endif
+
+OscillatorKernel render_oscillators = &render_oscillators_scalar;
+BlepKernel render_blep = &render_blep_scalar;
+VoiceFilterKernel filter_voices = &filter_voices_scalar;
+const char *oscillator_kernel_name = "scalar";
+
+void init_oscillator_kernels(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    render_oscillators = &render_oscillators_avx2;
+    render_blep = &render_blep_avx2;
+    filter_voices = &filter_voices_avx2;
+    oscillator_kernel_name = "AVX2";
+  }
+  else if (__builtin_cpu_supports("sse2"))
+  {
+    render_oscillators = &render_oscillators_sse2;
+    oscillator_kernel_name = "SSE2";
+  }
+#endif
+}
+
+/* the same random notes for every kernel */
+static void bench_oscillator_notes(uint32_t (*phase)[MAX_DETUNE_VOICES], uint32_t (*delta)[MAX_DETUNE_VOICES], int *level, int count)
+{
+  srand(1);
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t highest = 0;
+    for (int j = 0; j < MAX_DETUNE_VOICES; j++)
+    {
+      phase[i][j] = (uint32_t)rand() * 2654435761u;
+      delta[i][j] = (uint32_t)(key_to_frequency(24 + rand() % 72) / sample_rate * WAVEFORM_LENGTH * WAVEFORM_FIXED_MULTIPLIER);
+      highest = MAX(highest, delta[i][j]);
+    }
+    level[i] = waveform_mip_level(highest);
+  }
+}
+
+/* every synth oscillator at full polyphony and unison, for a second */
+void bench_oscillators(void)
+{
+  static uint32_t phase[MAX_SYNTH_POLYPHONY * NUM_SYNTH_OSC][MAX_DETUNE_VOICES];
+  static uint32_t delta[MAX_SYNTH_POLYPHONY * NUM_SYNTH_OSC][MAX_DETUNE_VOICES];
+  double out[64];
+  double reference[64];
+
+  struct {
+    const char *name;
+    OscillatorKernel kernel;
+    bool supported;
+  } kernels[] = {
+    { "scalar", &render_oscillators_scalar, true },
+#if defined(__x86_64__) || defined(__i386__)
+    { "SSE2", &render_oscillators_sse2, __builtin_cpu_supports("sse2") },
+    { "AVX2", &render_oscillators_avx2, __builtin_cpu_supports("avx2") },
+#endif
+  };
+
+  static int level[MAX_SYNTH_POLYPHONY * NUM_SYNTH_OSC];
+  struct timespec ts_start, ts_end;
+
+  init_tuning();
+  init_oscillator_kernels();
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
+  init_waveforms();
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
+  printf("Wavetables: %d shapes x %d levels x %d samples (%zu kB) built in %.2f ms\n",
+      WAVEFORM_SHAPES, WAVEFORM_MIP_LEVELS, WAVEFORM_LENGTH, sizeof(waveforms) / 1024,
+      1e3 * (ts_end.tv_sec - ts_start.tv_sec) + 1e-6 * (ts_end.tv_nsec - ts_start.tv_nsec));
+
+  int oscillators = ARRAY_SIZE(phase) * MAX_DETUNE_VOICES;
+  int frames = (int)sample_rate;
+  double scalar_time = 0.0;
+
+  for (int k = 0; k < ARRAY_SIZE(kernels); k++)
+  {
+    if (!kernels[k].supported)
+    {
+      printf("%-8s not supported by this CPU\n", kernels[k].name);
+      continue;
+    }
+
+    bench_oscillator_notes(phase, delta, level, ARRAY_SIZE(phase));
+    double checksum = 0.0;
+    bool identical = true;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    for (int n = 0; n < frames; n += ARRAY_SIZE(out))
+    {
+      memset(out, 0, sizeof(out));
+      for (int i = 0; i < ARRAY_SIZE(phase); i++)
+        kernels[k].kernel(get_waveform(i % WAVEFORM_SHAPES, level[i]), phase[i], delta[i], MAX_DETUNE_VOICES, out, ARRAY_SIZE(out));
+      checksum += out[0];
+
+      if (n == 0 && k == 0)
+        memcpy(reference, out, sizeof(out));
+      else if (n == 0)
+        identical = !memcmp(reference, out, sizeof(out));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    double t = (ts_end.tv_sec - ts_start.tv_sec) + 1e-9 * (ts_end.tv_nsec - ts_start.tv_nsec);
+    if (k == 0)
+      scalar_time = t;
+
+    printf("%-8s %d oscillators x %d frames in %.3f s, %.2f ns per oscillator sample, %.2fx scalar%s (checksum %f)\n",
+        kernels[k].name, oscillators, frames, t, 1e9 * t / ((double)oscillators * frames), scalar_time / t,
+        identical ? "" : ", DIFFERENT OUTPUT", checksum);
+  }
+
+  /* a voice reading its octave's table against all voices reading the
+   * full band level 0, with the kernel the synth uses */
+  int voices = ARRAY_SIZE(phase) / NUM_SYNTH_OSC;
+  for (int pass = 0; pass < 2; pass++)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    for (int n = 0; n < frames; n += ARRAY_SIZE(out))
+    {
+      memset(out, 0, sizeof(out));
+      for (int i = 0; i < ARRAY_SIZE(phase); i++)
+        render_oscillators(get_waveform(i % WAVEFORM_SHAPES, pass ? 0 : level[i]), phase[i], delta[i], MAX_DETUNE_VOICES, out, ARRAY_SIZE(out));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    double t = (ts_end.tv_sec - ts_start.tv_sec) + 1e-9 * (ts_end.tv_nsec - ts_start.tv_nsec);
+    printf("%-8s %.2f ns per voice sample (%d oscillators) reading %s\n",
+        oscillator_kernel_name, 1e9 * t / ((double)voices * frames), NUM_SYNTH_OSC * MAX_DETUNE_VOICES,
+        pass ? "level 0 only" : "mip levels");
+  }
+
+  struct {
+    const char *name;
+    BlepKernel kernel;
+    bool supported;
+  } blep_kernels[] = {
+    { "scalar", &render_blep_scalar, true },
+#if defined(__x86_64__) || defined(__i386__)
+    { "AVX2", &render_blep_avx2, __builtin_cpu_supports("avx2") },
+#endif
+  };
+
+  /* the same oscillators as PolyBLEP saw, square and triangle */
+  for (int k = 0; k < ARRAY_SIZE(blep_kernels); k++)
+  {
+    if (!blep_kernels[k].supported)
+      continue;
+    bench_oscillator_notes(phase, delta, level, ARRAY_SIZE(phase));
+
+    double checksum = 0.0;
+    bool identical = true;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    for (int n = 0; n < frames; n += ARRAY_SIZE(out))
+    {
+      memset(out, 0, sizeof(out));
+      for (int i = 0; i < ARRAY_SIZE(phase); i++)
+        blep_kernels[k].kernel(i % 3, phase[i], delta[i], MAX_DETUNE_VOICES, out, ARRAY_SIZE(out));
+      checksum += out[0];
+
+      if (n == 0 && k == 0)
+        memcpy(reference, out, sizeof(out));
+      else if (n == 0)
+        identical = !memcmp(reference, out, sizeof(out));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    double t = (ts_end.tv_sec - ts_start.tv_sec) + 1e-9 * (ts_end.tv_nsec - ts_start.tv_nsec);
+    if (k == 0)
+      scalar_time = t;
+
+    printf("%-8s PolyBLEP %.2f ns per oscillator sample, %.2fx scalar%s (checksum %f)\n",
+        blep_kernels[k].name, 1e9 * t / ((double)oscillators * frames), scalar_time / t,
+        identical ? "" : ", DIFFERENT OUTPUT", checksum);
+  }
+
+  struct {
+    const char *name;
+    VoiceFilterKernel kernel;
+    bool supported;
+  } filter_kernels[] = {
+    { "scalar", &filter_voices_scalar, true },
+#if defined(__x86_64__) || defined(__i386__)
+    { "AVX2", &filter_voices_avx2, __builtin_cpu_supports("avx2") },
+#endif
+  };
+
+  /* a filter on every voice at full polyphony */
+  static double input[SYNTH_RUN_FRAMES][MAX_SYNTH_POLYPHONY];
+  static double buffer[SYNTH_RUN_FRAMES][MAX_SYNTH_POLYPHONY];
+  double ic1[MAX_SYNTH_POLYPHONY], ic2[MAX_SYNTH_POLYPHONY];
+  double a1[MAX_SYNTH_POLYPHONY], a2[MAX_SYNTH_POLYPHONY], a3[MAX_SYNTH_POLYPHONY];
+  double filter_reference = 0.0;
+
+  for (int k = 0; k < ARRAY_SIZE(filter_kernels); k++)
+  {
+    if (!filter_kernels[k].supported)
+      continue;
+
+    srand(1);
+    for (int v = 0; v < MAX_SYNTH_POLYPHONY; v++)
+    {
+      double g = tan(M_PI * (100.0 + rand() % 10000) / sample_rate);
+      a1[v] = 1.0 / (1.0 + g * (g + 0.2));
+      a2[v] = g * a1[v];
+      a3[v] = g * a2[v];
+      ic1[v] = ic2[v] = 0.0;
+    }
+
+    for (int i = 0; i < SYNTH_RUN_FRAMES; i++)
+      for (int v = 0; v < MAX_SYNTH_POLYPHONY; v++)
+        input[i][v] = rand() / (double)RAND_MAX - 0.5;
+
+    double checksum = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &ts_start);
+    for (int n = 0; n < frames; n += SYNTH_RUN_FRAMES)
+    {
+      memcpy(buffer, input, sizeof(buffer));
+      filter_kernels[k].kernel(ic1, ic2, a1, a2, a3, buffer, MAX_SYNTH_POLYPHONY, SYNTH_RUN_FRAMES);
+      checksum += buffer[0][0] + buffer[SYNTH_RUN_FRAMES - 1][MAX_SYNTH_POLYPHONY - 1];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+    double t = (ts_end.tv_sec - ts_start.tv_sec) + 1e-9 * (ts_end.tv_nsec - ts_start.tv_nsec);
+    if (k == 0)
+    {
+      scalar_time = t;
+      filter_reference = checksum;
+    }
+
+    printf("%-8s filters %.2f ns per voice sample, %.2fx scalar%s (checksum %f)\n",
+        filter_kernels[k].name, 1e9 * t / ((double)MAX_SYNTH_POLYPHONY * frames), scalar_time / t,
+        checksum == filter_reference ? "" : ", DIFFERENT OUTPUT", checksum);
+  }
+}
+
+void allocate_main_buffers(int nframes)
+{
+  main_frames = nframes;
+  for (int i = 0; i < ARRAY_SIZE(main_output_buffer); i++)
+  {
+    FREE_IF_NOT_NULL(main_output_buffer[i]);
+    main_output_buffer[i] = allocate_double(main_frames);
+  }
+  for (int i = 0; i < ARRAY_SIZE(main_input_buffer); i++)
+  {
+    FREE_IF_NOT_NULL(main_input_buffer[i]);
+    main_input_buffer[i] = allocate_double(main_frames);
+  }
+
+  FREE_IF_NOT_NULL(empty_buffer);
+  empty_buffer = allocate_double(main_frames);
+
+  /* the graph pools are sized by main_frames */
+  recalculate_audio_graph();
+}
+
+void audio_buffer_size_callback(int nframes)
+{
+  printf("Buffer size set to %d\n", nframes);
+  if (nframes > 0)
+  {
+    allocate_main_buffers(nframes);
+  }
+}
+
+void audio_sample_rate_callback(double rate)
+{
+  sample_rate = rate;
+  printf("Sample rate: %f Hz\n", sample_rate);
+}
+
+void process_audio_synth(Instrument *inst, int nframes, const void **inputs, void **outputs);
+
+void process_audio_io_device(Instrument *inst, int nframes, const void **inputs, void **outputs)
+{
+  double *input_l = (double *)inputs[0];
+  double *input_r = (double *)inputs[1];
+
+  Param *volume = &inst->params[0];
+
+  if (main_output_port[0])
+  {
+    float *port_l = main_output_port[0];
+    float *port_r = main_output_port[1];
+
+    for (int i = 0; i < nframes; i++)
+    {
+      double v = param_next(volume);
+      port_l[i] = (float)(v * input_l[i]);
+      port_r[i] = (float)(v * input_r[i]);
+    }
+
+    return;
+  }
+
+  double *output_l = main_output_buffer[0];
+  double *output_r = main_output_buffer[1];
+
+  while (nframes--)
+  {
+    double v = param_next(volume);
+    output_l[0] = v * input_l[0];
+    output_r[0] = v * input_r[0];
+
+    input_l += 1;
+    input_r += 1;
+
+    output_l += 1;
+    output_r += 1;
+  }
+}
+
+void process_reverb(reverb_t *r, double *input_l, double *input_r, double *output_l, double *output_r, int nframes, Param *mix);
+
+void process_audio_chorus(Instrument *inst, int nframes, const void **inputs, void **outputs)
+{
+  double *input_l = (double *)inputs[0];
+  double *input_r = (double *)inputs[1];
+
+  double *output_l = (double *)outputs[0];
+  double *output_r = (double *)outputs[1];
+
+  process_reverb((reverb_t *)inst->specific_data, input_l, input_r, output_l, output_r, nframes, &inst->params[2]);
+#if 0
+  while (nframes--)
+  {
+    output_l[0] = input_l[0];
+    output_r[0] = input_r[0];
+
+
+
+    input_l += 1;
+    input_r += 1;
+    output_l += 1;
+    output_r += 1;
+  }
+#endif
+}
+
+/* Compiled form of the rack for the audio thread. Instruments are grouped by
+ * dependency level: everything in a level only reads buffers written by
+ * earlier levels, so the instruments of one level can run in parallel. */
+typedef struct GraphNode_ {
+  Instrument *inst;
+  double **inputs; /* resolved buffers, point into AudioGraph::ports */
+  double **outputs;
+} GraphNode;
+
+typedef struct AudioGraph_ {
+  GraphNode *nodes; /* execution order, sources first */
+  int count;
+  int *level_start; /* level_count + 1 offsets into nodes */
+  int level_count;
+  bool parallel; /* some level is wider than one instrument */
+
+  Instrument **outside; /* rendering instruments not connected to an output */
+  int outside_count;
+
+  double **ports;
+  double *pool; /* buffer_count buffers of main_frames */
+  int buffer_count;
+  int pool_frames;
+
+  atomic_int *level_next; /* next index in nodes to claim */
+  atomic_int *level_done; /* instruments of the level finished */
+} AudioGraph;
+
+AudioGraph audio_graphs[2];
+_Atomic(AudioGraph *) audio_graph;
+_Atomic(AudioGraph *) audio_graph_in_use; /* by the block being rendered */
+pthread_mutex_t audio_graph_mutex = PTHREAD_MUTEX_INITIALIZER; /* one rebuild at a time */
+
+#define MAX_AUDIO_WORKERS 16
+
+int audio_worker_count = -1; /* -1: one per additional core */
+pthread_t audio_workers[MAX_AUDIO_WORKERS];
+sem_t audio_worker_wakeup[MAX_AUDIO_WORKERS];
+AudioGraph *audio_workers_graph;
+atomic_int audio_workers_busy;
+bool audio_workers_started = false;
+
+static inline void cpu_relax(int *spins)
+{
+  if (++(*spins) < 1000)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+  else
+  {
+    /* somebody we wait for lost the CPU */
+    sched_yield();
+  }
+}
+
+enum {
+  GRAPH_UNVISITED = 0,
+  GRAPH_VISITING, /* on the DFS stack */
+  GRAPH_DONE
+};
+
+typedef struct {
+  Instrument *inst;
+  int next_input;
+} graph_dfs_frame;
+
+int buffer_pool_peak;
+
+/* Register allocation for the output buffers. An output lives from the
+ * level of its producer to the last level reading it, a buffer is free again
+ * once that level has finished and can be taken by any later level. Levels
+ * rather than positions in the order are used because the instruments of a
+ * level run at the same time. Feedback outputs are read in the next period
+ * and get buffers of their own that are never reused. */
+void assign_graph_buffers(AudioGraph *g, int num_instruments)
+{
+  int num_ports = 0;
+  int *output_base = malloc((g->count + 1) * sizeof(int));
+  for (int i = 0; i < g->count; i++)
+  {
+    output_base[i] = num_ports;
+    num_ports += g->nodes[i].inst->num_outputs;
+  }
+  output_base[g->count] = num_ports;
+
+  int num_outputs = num_ports;
+  for (int i = 0; i < g->count; i++)
+    num_ports += g->nodes[i].inst->num_inputs;
+
+  /* last level using each output, INT_MAX for feedback */
+  int *last_use = malloc(MAX(num_outputs, 1) * sizeof(int));
+  int *buffer_of = malloc(MAX(num_outputs, 1) * sizeof(int));
+  for (int i = 0; i < g->count; i++)
+  {
+    Instrument *inst = g->nodes[i].inst;
+    for (int j = 0; j < inst->num_outputs; j++)
+      last_use[output_base[i] + j] = inst->graph_level;
+  }
+
+  for (int i = 0; i < g->count; i++)
+  {
+    Instrument *inst = g->nodes[i].inst;
+    for (int j = 0; j < inst->num_inputs; j++)
+    {
+      Instrument *src = inst->inputs[j].target_inst;
+      if (!src || src->graph_mark != GRAPH_DONE)
+        continue;
+
+      int out = output_base[src->graph_index] + inst->inputs[j].target_connection;
+      if (inst->inputs[j].feedback)
+        last_use[out] = INT_MAX;
+      else
+        last_use[out] = MAX(last_use[out], inst->graph_level);
+    }
+  }
+
+  /* buffers released at the end of each level */
+  int *free_list = malloc(MAX(num_outputs, 1) * sizeof(int));
+  int free_count = 0;
+  int *release_next = malloc(MAX(num_outputs, 1) * sizeof(int));
+  int *release_head = malloc(MAX(g->level_count, 1) * sizeof(int));
+  for (int l = 0; l < g->level_count; l++)
+    release_head[l] = -1;
+
+  int buffer_count = 0;
+  for (int l = 0; l < g->level_count; l++)
+  {
+    if (l > 0)
+    {
+      for (int out = release_head[l - 1]; out >= 0; out = release_next[out])
+        free_list[free_count++] = buffer_of[out];
+    }
+
+    for (int i = g->level_start[l]; i < g->level_start[l + 1]; i++)
+    {
+      for (int out = output_base[i]; out < output_base[i + 1]; out++)
+      {
+        /* a feedback output is still read next period, after the earlier
+         * levels have written again, so it never shares a buffer */
+        if (last_use[out] == INT_MAX)
+        {
+          buffer_of[out] = buffer_count++;
+          continue;
+        }
+
+        buffer_of[out] = free_count > 0 ? free_list[--free_count] : buffer_count++;
+        release_next[out] = release_head[last_use[out]];
+        release_head[last_use[out]] = out;
+      }
+    }
+  }
+
+  if (buffer_count > g->buffer_count || g->pool_frames != main_frames)
+  {
+    free(g->pool);
+    g->pool = allocate_double(MAX(buffer_count, 1) * main_frames);
+    g->buffer_count = buffer_count;
+    g->pool_frames = main_frames;
+  }
+  else
+  {
+    /* feedback inputs read whatever is in the pool first */
+    memset(g->pool, 0, g->buffer_count * main_frames * sizeof(double));
+  }
+
+  g->ports = realloc(g->ports, MAX(num_ports, 1) * sizeof(double *));
+  for (int out = 0; out < num_outputs; out++)
+    g->ports[out] = g->pool + (size_t)buffer_of[out] * main_frames;
+
+  double **port = g->ports + num_outputs;
+  for (int i = 0; i < g->count; i++)
+  {
+    GraphNode *node = &g->nodes[i];
+    Instrument *inst = node->inst;
+
+    node->outputs = g->ports + output_base[i];
+    node->inputs = port;
+    port += inst->num_inputs;
+    for (int j = 0; j < inst->num_inputs; j++)
+    {
+      Instrument *src = inst->inputs[j].target_inst;
+      if (src && src->graph_mark == GRAPH_DONE)
+        node->inputs[j] = g->ports[output_base[src->graph_index] + inst->inputs[j].target_connection];
+      else
+        node->inputs[j] = empty_buffer;
+    }
+  }
+
+  buffer_pool_peak = MAX(buffer_pool_peak, buffer_count);
+  printf("Audio graph: %d of %d instruments in %d levels, %d buffers for %d outputs (%d KiB, peak %d buffers)\n",
+      g->count, num_instruments, g->level_count, buffer_count, num_outputs,
+      (int)((size_t)buffer_count * main_frames * sizeof(double) / 1024), buffer_pool_peak);
+
+  free(output_base);
+  free(last_use);
+  free(buffer_of);
+  free(free_list);
+  free(release_next);
+  free(release_head);
+}
+
+/* Topological order by an iterative depth first search along the inputs,
+ * starting from the output devices (instruments without outputs), O(V + E).
+ * An input whose source is still on the DFS stack closes a cycle. It is
+ * marked as feedback and ignored for the ordering: the consumer then runs
+ * before the source and reads the block the source wrote in the previous
+ * period, a one block delay that keeps the graph acyclic. */
+void recalculate_audio_graph(void)
+{
+  int num_instruments = 0;
+  for (Instrument *inst = the_rack.first; inst; inst = inst->next)
+  {
+    inst->graph_mark = GRAPH_UNVISITED;
+    num_instruments++;
+  }
+
+  pthread_mutex_lock(&audio_graph_mutex);
+
+  AudioGraph *g = (atomic_load(&audio_graph) == &audio_graphs[0]) ? &audio_graphs[1] : &audio_graphs[0];
+
+  /* a block that started before the last switch may still run the
+   * inactive graph, it is rebuilt once the audio thread has left it */
+  int spins = 0;
+  while (atomic_load(&audio_graph_in_use) == g)
+    cpu_relax(&spins);
+
+  Instrument **order = malloc(MAX(num_instruments, 1) * sizeof(Instrument *));
+  graph_dfs_frame *stack = malloc(MAX(num_instruments, 1) * sizeof(graph_dfs_frame));
+
+  int count = 0;
+  int level_count = 0;
+
+  for (Instrument *root = the_rack.first; root; root = root->next)
+  {
+    if (root->num_outputs > 0 || !root->process_audio || root->graph_mark != GRAPH_UNVISITED)
+      continue;
+
+    int stack_pos = 0;
+    stack[stack_pos++] = (graph_dfs_frame){root, 0};
+    root->graph_mark = GRAPH_VISITING;
+
+    while (stack_pos > 0)
+    {
+      graph_dfs_frame *top = &stack[stack_pos - 1];
+      Instrument *current = top->inst;
+
+      if (top->next_input < current->num_inputs)
+      {
+        Connection *conn = &current->inputs[top->next_input++];
+        Instrument *src = conn->target_inst;
+
+        conn->feedback = false;
+        if (!src || !src->process_audio)
+          continue;
+
+        if (src->graph_mark == GRAPH_VISITING)
+        {
+          printf("Feedback loop %s -> %s, delayed by one block\n", src->name, current->name);
+          conn->feedback = true;
+        }
+        else if (src->graph_mark == GRAPH_UNVISITED)
+        {
+          src->graph_mark = GRAPH_VISITING;
+          stack[stack_pos++] = (graph_dfs_frame){src, 0};
+        }
+      }
+      else
+      {
+        /* post order: all sources are placed already */
+        int level = 0;
+        for (int i = 0; i < current->num_inputs; i++)
+        {
+          Instrument *src = current->inputs[i].target_inst;
+          if (src && src->process_audio && !current->inputs[i].feedback)
+            level = MAX(level, src->graph_level + 1);
+        }
+        current->graph_level = level;
+        level_count = MAX(level_count, level + 1);
+
+        current->graph_mark = GRAPH_DONE;
+        order[count++] = current;
+        stack_pos--;
+      }
+    }
+  }
+
+  free(stack);
+
+  g->level_start = realloc(g->level_start, (level_count + 1) * sizeof(int));
+  g->level_next = realloc(g->level_next, MAX(level_count, 1) * sizeof(atomic_int));
+  g->level_done = realloc(g->level_done, MAX(level_count, 1) * sizeof(atomic_int));
+  g->count = count;
+  g->level_count = level_count;
+  g->parallel = false;
+
+  /* counting sort by level, keeps the DFS order inside a level */
+  memset(g->level_start, 0, (level_count + 1) * sizeof(int));
+  for (int i = 0; i < count; i++)
+    g->level_start[order[i]->graph_level + 1]++;
+  for (int l = 0; l < level_count; l++)
+  {
+    g->level_start[l + 1] += g->level_start[l];
+    if (g->level_start[l + 1] - g->level_start[l] > 1)
+      g->parallel = true;
+  }
+
+  for (int l = 0; l < level_count; l++)
+    atomic_init(&g->level_next[l], g->level_start[l]);
+
+  g->nodes = realloc(g->nodes, MAX(count, 1) * sizeof(GraphNode));
+  for (int i = 0; i < count; i++)
+  {
+    Instrument *inst = order[i];
+    inst->graph_index = atomic_fetch_add(&g->level_next[inst->graph_level], 1);
+    g->nodes[inst->graph_index].inst = inst;
+  }
+  free(order);
+
+  g->outside = realloc(g->outside, MAX(num_instruments - count, 1) * sizeof(Instrument *));
+  g->outside_count = 0;
+  for (Instrument *inst = the_rack.first; inst; inst = inst->next)
+  {
+    if (inst->process_audio && inst->graph_mark != GRAPH_DONE)
+      g->outside[g->outside_count++] = inst;
+  }
+
+  assign_graph_buffers(g, num_instruments);
+
+  /* switch atomically */
+  atomic_store(&audio_graph, g);
+
+  pthread_mutex_unlock(&audio_graph_mutex);
+}
+
+/* the block is rendered in pieces, split at the frames of the MIDI events */
+void process_instrument(GraphNode *node)
+{
+  Instrument *inst = node->inst;
+
+  if (inst->midi_event_count == 0)
+  {
+    inst->process_audio(inst, main_frames, (const void **)node->inputs, (void **)node->outputs);
+    return;
+  }
+
+  double *inputs[64];
+  double *outputs[64];
+  int pos = 0;
+
+  for (int e = 0; e <= inst->midi_event_count; e++)
+  {
+    int end = e < inst->midi_event_count ? inst->midi_events[e].frame : main_frames;
+
+    if (end > pos)
+    {
+      for (int i = 0; i < inst->num_inputs; i++)
+        inputs[i] = node->inputs[i] + pos;
+      for (int i = 0; i < inst->num_outputs; i++)
+        outputs[i] = node->outputs[i] + pos;
+
+      inst->process_audio(inst, end - pos, (const void **)inputs, (void **)outputs);
+      pos = end;
+    }
+
+    if (e < inst->midi_event_count)
+    {
+      MidiEvent *event = &inst->midi_events[e];
+      inst->process_midi(inst, event->key, event->note_on, event->velocity);
+    }
+  }
+
+  inst->midi_event_count = 0;
+}
+
+/* events of an instrument that isn't rendered are played at once, they
+ * would otherwise pile up and sound when it gets connected */
+void flush_instrument_midi(Instrument *inst)
+{
+  for (int e = 0; e < inst->midi_event_count; e++)
+  {
+    MidiEvent *event = &inst->midi_events[e];
+    inst->process_midi(inst, event->key, event->note_on, event->velocity);
+  }
+
+  inst->midi_event_count = 0;
+}
+
+/* run by the caller of process_audio and by every worker, level by level */
+void run_graph_levels(AudioGraph *g)
+{
+  for (int l = 0; l < g->level_count; l++)
+  {
+    int end = g->level_start[l + 1];
+    int width = end - g->level_start[l];
+
+    int i;
+    while ((i = atomic_fetch_add(&g->level_next[l], 1)) < end)
+    {
+      process_instrument(&g->nodes[i]);
+      atomic_fetch_add(&g->level_done[l], 1);
+    }
+
+    int spins = 0;
+    while (atomic_load(&g->level_done[l]) < width)
+      cpu_relax(&spins);
+  }
+}
+
+void *audio_worker_func(void *arg)
+{
+  int index = (int)(intptr_t)arg;
+
+  while (1)
+  {
+    if (sem_wait(&audio_worker_wakeup[index]) != 0)
+      continue; /* EINTR */
+
+    run_graph_levels(audio_workers_graph);
+    atomic_fetch_sub(&audio_workers_busy, 1);
+  }
+
+  return NULL;
+}
+
+void start_audio_workers(void)
+{
+  if (audio_workers_started)
+    return;
+  audio_workers_started = true;
+
+  int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (audio_worker_count < 0)
+    audio_worker_count = cpus - 1;
+  audio_worker_count = MIN(MAX(audio_worker_count, 0), MAX_AUDIO_WORKERS);
+
+  for (int i = 0; i < audio_worker_count; i++)
+  {
+    sem_init(&audio_worker_wakeup[i], 0, 0);
+    if (pthread_create(&audio_workers[i], NULL, &audio_worker_func, (void *)(intptr_t)i))
+    {
+      fprintf(stderr, "Failed to start audio worker %d\n", i);
+      audio_worker_count = i;
+      break;
+    }
+
+    /* keep the caller's core free, the workers take the others */
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((i + 1) % MAX(cpus, 1), &set);
+    pthread_setaffinity_np(audio_workers[i], sizeof(set), &set);
+
+    /* best effort, needs rtprio permissions */
+    struct sched_param param = { .sched_priority = 60 };
+    pthread_setschedparam(audio_workers[i], SCHED_FIFO, &param);
+  }
+
+  printf("Audio graph runs on %d worker thread(s) plus the audio thread\n", audio_worker_count);
+}
+
+void run_graph(AudioGraph *g)
+{
+  if (!g->parallel || audio_worker_count <= 0)
+  {
+    for (int i = 0; i < g->count; i++)
+      process_instrument(&g->nodes[i]);
+    return;
+  }
+
+  for (int l = 0; l < g->level_count; l++)
+  {
+    atomic_store(&g->level_next[l], g->level_start[l]);
+    atomic_store(&g->level_done[l], 0);
+  }
+
+  audio_workers_graph = g;
+  atomic_store(&audio_workers_busy, audio_worker_count);
+  for (int i = 0; i < audio_worker_count; i++)
+    sem_post(&audio_worker_wakeup[i]);
+
+  run_graph_levels(g);
+
+  /* the graph may be reset by the next period only after every worker left it */
+  int spins = 0;
+  while (atomic_load(&audio_workers_busy) > 0)
+    cpu_relax(&spins);
+}
+
+void process_audio(void)
+{
+  AudioGraph *g;
+
+  /* announced before use, if the graph was switched meanwhile the new one
+   * is taken; recalculate_audio_graph then sees the right one in use */
+  do
+  {
+    g = atomic_load(&audio_graph);
+    atomic_store(&audio_graph_in_use, g);
+  } while (g != atomic_load(&audio_graph));
+
+  atomic_fetch_add(&audio_block_count, 1);
+
+  /* the same handshake for the tracks, a held block doesn't touch them */
+  atomic_store(&tracks_in_use, true);
+  seq_tracks_held = atomic_load(&tracks_held);
+  if (seq_tracks_held)
+    atomic_store(&tracks_in_use, false);
+
+  receive_params();
+  sequencer_process(main_frames);
+  receive_midi();
+  atomic_store(&tracks_in_use, false);
+
+  if (g)
+  {
+    run_graph(g);
+    for (int i = 0; i < g->outside_count; i++)
+      flush_instrument_midi(g->outside[i]);
+  }
+
+  atomic_store(&audio_graph_in_use, NULL);
+}
+
+static inline Event *event_at(EventBatch *batch, int index)
+{
+  EventChunk **chunks = atomic_load_explicit(&batch->chunks, memory_order_acquire);
+
+  return &chunks[index / EVENT_CHUNK_SIZE]->events[index % EVENT_CHUNK_SIZE];
+}
+
+/* old chunk tables, freed when the audio thread can't be reading them */
+void *retired_tables[64];
+uint64_t retired_block[64];
+int retired_count;
+
+void free_retired_tables(void)
+{
+  uint64_t now = atomic_load(&audio_block_count);
+
+  int kept = 0;
+  for (int i = 0; i < retired_count; i++)
+  {
+    /* a block that started before the swap has finished */
+    if (now >= retired_block[i] + 2)
+      free(retired_tables[i]);
+    else
+    {
+      retired_tables[kept] = retired_tables[i];
+      retired_block[kept++] = retired_block[i];
+    }
+  }
+  retired_count = kept;
+}
+
+void retire_table(void *table)
+{
+  if (retired_count < ARRAY_SIZE(retired_tables))
+  {
+    retired_tables[retired_count] = table;
+    retired_block[retired_count++] = atomic_load(&audio_block_count);
+  }
+  /* else leaked, only happens if the audio thread is stuck */
+}
+
+/* not for the audio thread; from the next block on the audio thread leaves
+ * the tracks alone, waits for a block still reading them */
+void hold_tracks(void)
+{
+  atomic_store(&tracks_held, true);
+
+  int spins = 0;
+  while (atomic_load(&tracks_in_use))
+    cpu_relax(&spins);
+}
+
+void release_tracks(void)
+{
+  atomic_store(&tracks_held, false);
+}
+
+/* not for the audio thread, makes room for n more events */
+bool event_batch_reserve(EventBatch *batch, int n)
+{
+  int needed = (batch->event_count + n + EVENT_CHUNK_SIZE - 1) / EVENT_CHUNK_SIZE;
+  int count = atomic_load(&batch->chunk_count);
+
+  if (needed <= count)
+    return true;
+
+  EventChunk **table = atomic_load(&batch->chunks);
+
+  if (needed > batch->chunk_capacity)
+  {
+    int capacity = MAX(needed, MAX(2 * batch->chunk_capacity, 16));
+    EventChunk **new_table = malloc(capacity * sizeof(EventChunk *));
+    if (!new_table)
+      return false;
+
+    if (count > 0)
+      memcpy(new_table, table, count * sizeof(EventChunk *));
+
+    atomic_store_explicit(&batch->chunks, new_table, memory_order_release);
+    batch->chunk_capacity = capacity;
+
+    if (table)
+      retire_table(table);
+    table = new_table;
+  }
+
+  for (; count < needed; count++)
+  {
+    table[count] = malloc(sizeof(EventChunk));
+    if (!table[count])
+      return false;
+
+    atomic_store_explicit(&batch->chunk_count, count + 1, memory_order_release);
+  }
+
+  return true;
+}
+
+/* not for the audio thread */
+Event *event_batch_append(EventBatch *batch)
+{
+  if (!event_batch_reserve(batch, 1))
+    return NULL;
+
+  return event_at(batch, batch->event_count++);
+}
+
+/* not for the audio thread, keeps the chunks */
+void clear_event_batch(EventBatch *batch)
+{
+  batch->event_count = 0;
+  memset(batch->open_note, 0, sizeof(batch->open_note));
+}
+
+/* not for the audio thread, the tracks must be held (hold_tracks); drops
+ * the events and frees the chunks the batch owns */
+void free_event_batch(EventBatch *batch)
+{
+  EventChunk **table = atomic_load(&batch->chunks);
+  int count = atomic_load(&batch->chunk_count);
+
+  clear_event_batch(batch);
+  atomic_store(&batch->chunk_count, 0);
+  atomic_store(&batch->chunks, NULL);
+
+  for (int i = batch->mapped_chunks; i < count; i++)
+    free(table[i]);
+  free(table);
+
+  batch->chunk_capacity = 0;
+  batch->mapped_chunks = 0;
+}
+
+/* not for the audio thread, the batch must be empty; the events stay in
+ * memory owned by the caller, e.g. a mapped song file, padded to whole chunks */
+bool map_event_batch(EventBatch *batch, EventChunk *chunks, int event_count)
+{
+  int count = (event_count + EVENT_CHUNK_SIZE - 1) / EVENT_CHUNK_SIZE;
+  int capacity = MAX(count, 16);
+  EventChunk **table = malloc(capacity * sizeof(EventChunk *));
+  if (!table)
+    return false;
+
+  for (int i = 0; i < count; i++)
+    table[i] = &chunks[i];
+
+  atomic_store_explicit(&batch->chunks, table, memory_order_release);
+  atomic_store_explicit(&batch->chunk_count, count, memory_order_release);
+  batch->chunk_capacity = capacity;
+  batch->mapped_chunks = count;
+  batch->event_count = event_count;
+
+  return true;
+}
+
+int compare_events(const void *a, const void *b)
+{
+  const Event *ea = a;
+  const Event *eb = b;
+
+  return (ea->tick > eb->tick) - (ea->tick < eb->tick);
+}
+
+/* not for the audio thread, for loaders that can't append in order */
+void sort_event_batch(EventBatch *batch)
+{
+  int n = batch->event_count;
+  bool sorted = true;
+  for (int i = 1; i < n && sorted; i++)
+    sorted = event_at(batch, i - 1)->tick <= event_at(batch, i)->tick;
+
+  if (sorted)
+    return;
+
+  Event *tmp = malloc(n * sizeof(Event));
+  for (int i = 0; i < n; i++)
+    tmp[i] = *event_at(batch, i);
+  qsort(tmp, n, sizeof(Event), &compare_events);
+  for (int i = 0; i < n; i++)
+    *event_at(batch, i) = tmp[i];
+  free(tmp);
+}
+
+/* called regularly by the GUI, keeps a free chunk ahead of the recording */
+void sequencer_reserve(void)
+{
+  if (atomic_exchange(&recording_overflow, false))
+    printf("Recording buffer full\n");
+  if (tempo_map_pending)
+    compile_tempo_map();
+
+  free_retired_tables();
+  event_batch_reserve(&sequencer_data.track[atomic_load(&sequencer_data.record_track)], EVENT_CHUNK_SIZE);
+}
+
+typedef struct {
+  Instrument *inst;
+  MidiEvent event;
+} MidiMessage;
+
+/* the backend thread (hardware input) and the GUI each have their own queue
+ * to the audio thread */
+MidiMessage midi_in_queue_data[1024];
+spsc_queue midi_in_queue = { (char *)midi_in_queue_data, sizeof(MidiMessage), ARRAY_SIZE(midi_in_queue_data) - 1 };
+MidiMessage midi_gui_queue_data[1024];
+spsc_queue midi_gui_queue = { (char *)midi_gui_queue_data, sizeof(MidiMessage), ARRAY_SIZE(midi_gui_queue_data) - 1 };
+
+/* keys outside the MIDI range are dropped, the synth and recorder index by key */
+void midi_note_play(spsc_queue *q, int frame, int key, int note_on, int velocity)
+{
+  if (midi_input_instrument && key >= 0 && key <= 127)
+  {
+    MidiMessage m = { midi_input_instrument, { frame, key, note_on, velocity } };
+
+    if (!spsc_push(q, &m))
+      printf("MIDI queue full\n");
+  }
+}
+
+/* called from the GUI thread, played at the start of the next block */
+void midi_user_input(int key, int note_on, int velocity)
+{
+  midi_note_play(&midi_gui_queue, 0, key, note_on, velocity);
+}
+
+/* audio thread: adds the event to the block of the instrument */
+void deliver_midi(Instrument *inst, MidiEvent event)
+{
+  if (!inst || !inst->process_midi)
+    return;
+
+  if (!inst->process_audio || inst->midi_event_count == ARRAY_SIZE(inst->midi_events))
+  {
+    /* not rendered or too many events, no point in waiting */
+    inst->process_midi(inst, event.key, event.note_on, event.velocity);
+    return;
+  }
+
+  event.frame = MIN(MAX(event.frame, 0), main_frames - 1);
+
+  /* insertion, events arrive nearly sorted */
+  int j = inst->midi_event_count++;
+  while (j > 0 && inst->midi_events[j - 1].frame > event.frame)
+  {
+    inst->midi_events[j] = inst->midi_events[j - 1];
+    j--;
+  }
+  inst->midi_events[j] = event;
+}
+
+/* Tempo map compiled into segments of constant tempo, each knowing its
+ * start in seconds, so converting between ticks and time is a binary search
+ * or, while playing, a look at the current segment. */
+typedef struct {
+  uint32_t tick;
+  double time;
+  double seconds_per_tick;
+  double bpm;
+} TempoSegment;
+
+typedef struct {
+  TempoSegment segments[MAX_TEMPO_POINTS];
+  int count;
+} TempoMap;
+
+TempoMap tempo_maps[2];
+_Atomic(TempoMap *) tempo_map;
+_Atomic(TempoMap *) tempo_map_in_use; /* the audio thread's acknowledgement */
+bool tempo_map_pending; /* a compile waits for the acknowledgement */
+
+/* not for the audio thread, publishes sequencer_data.tempo */
+void compile_tempo_map(void)
+{
+  TempoMap *current = atomic_load(&tempo_map);
+  TempoMap *m = (current == &tempo_maps[0]) ? &tempo_maps[1] : &tempo_maps[0];
+
+  /* until the audio thread has picked up the last map it may still use
+   * the spare one, the compile is then redone by sequencer_reserve */
+  if (atomic_load(&tempo_map_in_use) == m)
+  {
+    tempo_map_pending = true;
+    return;
+  }
+  tempo_map_pending = false;
+
+  TempoPoint *points = sequencer_data.tempo;
+  int count = sequencer_data.tempo_count;
+
+  m->count = 0;
+  double time = 0.0;
+  for (int i = 0; i < MAX(count, 1); i++)
+  {
+    /* the first tempo holds from the start */
+    uint32_t tick = (i == 0) ? 0 : points[i].tick;
+    double segment_bpm = count > 0 ? points[i].bpm : 120.0;
+
+    if (m->count > 0)
+    {
+      TempoSegment *prev = &m->segments[m->count - 1];
+      time = prev->time + (tick - prev->tick) * prev->seconds_per_tick;
+    }
+
+    m->segments[m->count++] = (TempoSegment){ tick, time, 60.0 / (segment_bpm * PPQ), segment_bpm };
+  }
+
+  atomic_store_explicit(&tempo_map, m, memory_order_release);
+}
+
+/* not for the audio thread, inserts or replaces a tempo change */
+void add_tempo_point(uint32_t tick, double new_bpm)
+{
+  TempoPoint *points = sequencer_data.tempo;
+  int i = 0;
+  while (i < sequencer_data.tempo_count && points[i].tick < tick)
+    i++;
+
+  if (i == sequencer_data.tempo_count || points[i].tick != tick)
+  {
+    if (sequencer_data.tempo_count == MAX_TEMPO_POINTS)
+      return;
+    memmove(&points[i + 1], &points[i], (sequencer_data.tempo_count - i) * sizeof(TempoPoint));
+    sequencer_data.tempo_count++;
+  }
+
+  points[i] = (TempoPoint){ tick, new_bpm };
+}
+
+/* not for the audio thread, changes the tempo in effect at the tick */
+void set_tempo_at(uint32_t tick, double new_bpm)
+{
+  int i = sequencer_data.tempo_count - 1;
+  while (i > 0 && sequencer_data.tempo[i].tick > tick)
+    i--;
+
+  if (i < 0)
+    add_tempo_point(0, new_bpm);
+  else
+    sequencer_data.tempo[i].bpm = new_bpm;
+
+  compile_tempo_map();
+}
+
+/* The song position is kept in rendered frames. The frame where the song
+ * starts (the origin) is set on a seek or a tempo map change, ticks are
+ * derived from the frames since then, so playback does not drift and an
+ * event lands on the same frame at any block size. */
+int64_t seq_frame; /* frames played since start */
+int64_t seq_block_frame; /* start of the current block */
+int64_t seq_origin_frame;
+TempoMap *seq_map;
+int seq_segment; /* cursor into seq_map */
+
+uint32_t seq_seek_tick;
+atomic_bool seq_seek_pending = true; /* places the cursors on the first block */
+
+#define NUM_TRACKS ARRAY_SIZE(sequencer_data.track)
+
+/* index of the next event to play in each track, tracks are sorted by time */
+int track_cursor[NUM_TRACKS];
+
+/* tracks with events left, min-heap by the time of the event at the cursor,
+ * merges the tracks into one stream in time order */
+int track_heap[NUM_TRACKS];
+int track_heap_count;
+
+static inline bool track_before(int a, int b)
+{
+  uint32_t ta = event_at(&sequencer_data.track[a], track_cursor[a])->tick;
+  uint32_t tb = event_at(&sequencer_data.track[b], track_cursor[b])->tick;
+
+  return ta < tb || (ta == tb && a < b);
+}
+
+void track_heap_down(int i)
+{
+  int track = track_heap[i];
+  while (1)
+  {
+    int child = 2 * i + 1;
+    if (child >= track_heap_count)
+      break;
+    if (child + 1 < track_heap_count && track_before(track_heap[child + 1], track_heap[child]))
+      child++;
+    if (!track_before(track_heap[child], track))
+      break;
+    track_heap[i] = track_heap[child];
+    i = child;
+  }
+  track_heap[i] = track;
+}
+
+void track_heap_build(void)
+{
+  track_heap_count = 0;
+  for (int t = 0; t < NUM_TRACKS; t++)
+  {
+    if (track_cursor[t] < sequencer_data.track[t].event_count)
+      track_heap[track_heap_count++] = t;
+  }
+
+  for (int i = track_heap_count / 2 - 1; i >= 0; i--)
+    track_heap_down(i);
+}
+
+typedef struct {
+  int64_t frame;
+  int key;
+  Instrument *inst;
+} PendingNoteOff;
+
+/* note-offs of the notes the sequencer started, min-heap by frame */
+PendingNoteOff note_off_heap[1024];
+int note_off_count;
+
+void note_off_push(int64_t frame, int key, Instrument *inst)
+{
+  int i = note_off_count++;
+  while (i > 0 && note_off_heap[(i - 1) / 2].frame > frame)
+  {
+    note_off_heap[i] = note_off_heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  note_off_heap[i] = (PendingNoteOff){ frame, key, inst };
+}
+
+PendingNoteOff note_off_pop(void)
+{
+  PendingNoteOff top = note_off_heap[0];
+  PendingNoteOff last = note_off_heap[--note_off_count];
+
+  int i = 0;
+  while (1)
+  {
+    int child = 2 * i + 1;
+    if (child >= note_off_count)
+      break;
+    if (child + 1 < note_off_count && note_off_heap[child + 1].frame < note_off_heap[child].frame)
+      child++;
+    if (last.frame <= note_off_heap[child].frame)
+      break;
+    note_off_heap[i] = note_off_heap[child];
+    i = child;
+  }
+  if (note_off_count > 0)
+    note_off_heap[i] = last;
+
+  return top;
+}
+
+void sequencer_note(Instrument *inst, int frame, int key, int note_on, int velocity)
+{
+  deliver_midi(inst ? inst : midi_input_instrument, (MidiEvent){ frame, key, note_on, velocity });
+}
+
+/* end the notes of the sequencer at the start of the block */
+void flush_note_offs(void)
+{
+  while (note_off_count > 0)
+  {
+    PendingNoteOff off = note_off_pop();
+    sequencer_note(off.inst, 0, off.key, 0, 0);
+  }
+}
+
+/* segment holding the tick, the current one is checked first */
+TempoSegment *segment_at_tick(int64_t tick)
+{
+  TempoSegment *seg = seq_map->segments;
+  int n = seq_map->count;
+  int c = seq_segment;
+
+  if (tick >= seg[c].tick && (c + 1 == n || tick < seg[c + 1].tick))
+    return &seg[c];
+
+  int lo = 0;
+  int hi = n - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (seg[mid].tick <= tick)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return &seg[lo];
+}
+
+TempoSegment *segment_at_time(double time)
+{
+  TempoSegment *seg = seq_map->segments;
+  int n = seq_map->count;
+  int c = seq_segment;
+
+  if (time >= seg[c].time && (c + 1 == n || time < seg[c + 1].time))
+    return &seg[c];
+
+  int lo = 0;
+  int hi = n - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (seg[mid].time <= time)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return &seg[lo];
+}
+
+/* frames from the song start */
+double tick_to_song_frame(double tick)
+{
+  TempoSegment *seg = segment_at_tick((int64_t)floor(tick));
+
+  return (seg->time + (tick - seg->tick) * seg->seconds_per_tick) * sample_rate;
+}
+
+/* the rounding errors of the map must not push a tick that falls exactly
+ * on a frame to the next one */
+static inline int64_t frames_ceil(double frames)
+{
+  return (int64_t)ceil(frames - 1e-6);
+}
+
+/* first frame at or after the tick */
+int64_t tick_to_frame(int64_t tick)
+{
+  return seq_origin_frame + frames_ceil(tick_to_song_frame(tick));
+}
+
+double frame_to_tick(int64_t frame)
+{
+  double time = (frame - seq_origin_frame) / sample_rate;
+  TempoSegment *seg = segment_at_time(time);
+
+  return seg->tick + (time - seg->time) / seg->seconds_per_tick;
+}
+
+/* the tick will be played at the frame */
+void set_origin(int64_t frame, double tick)
+{
+  seq_origin_frame = frame - frames_ceil(tick_to_song_frame(tick));
+}
+
+/* first tick played at or after the frame */
+int64_t first_tick_at(int64_t frame)
+{
+  int64_t tick = (int64_t)ceil(frame_to_tick(frame));
+
+  /* exact with respect to the rounding in tick_to_frame */
+  while (tick_to_frame(tick - 1) >= frame)
+    tick--;
+  while (tick_to_frame(tick) < frame)
+    tick++;
+
+  return tick;
+}
+
+/* index of the first event at or after the tick */
+int find_event(EventBatch *batch, int64_t tick)
+{
+  int lo = 0;
+  int hi = batch->event_count;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (event_at(batch, mid)->tick < tick)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+bool recording_notes; /* audio thread, recording and playing in the last block */
+int seq_record_track; /* audio thread, the track recorded to */
+
+/* audio thread, the events are kept sorted so the cursors stay valid */
+void record_midi(int frame, int key, int note_on, int velocity)
+{
+  int track = seq_record_track;
+  EventBatch *batch = &sequencer_data.track[track];
+  int64_t tick = MAX((int64_t)floor(frame_to_tick(seq_block_frame + frame) + 0.5), 0);
+
+  /* a note still open for the key ends here */
+  int open = batch->open_note[key];
+  if (open)
+  {
+    Event *event = event_at(batch, open - 1);
+    event->duration = (uint32_t)MAX(tick - (int64_t)event->tick, 1); /* 0 is still recording */
+    batch->open_note[key] = 0;
+  }
+
+  if (note_on)
+  {
+    if (batch->event_count >= atomic_load_explicit(&batch->chunk_count, memory_order_acquire) * EVENT_CHUNK_SIZE)
+    {
+      atomic_store(&recording_overflow, true);
+      return;
+    }
+
+    /* after the events at the same time, usually at the end; the notes
+     * still held behind it move up with the events */
+    int pos = find_event(batch, tick + 1);
+    for (int i = batch->event_count; i > pos; i--)
+      *event_at(batch, i) = *event_at(batch, i - 1);
+    if (pos < batch->event_count)
+    {
+      for (int k = 0; k < ARRAY_SIZE(batch->open_note); k++)
+        if (batch->open_note[k] > pos)
+          batch->open_note[k]++;
+    }
+
+    Event *event = event_at(batch, pos);
+    event->tick = (uint32_t)tick;
+    event->type = ET_NOTE;
+    event->val1 = key;
+    event->val2 = velocity;
+    event->val3 = 0;
+    event->duration = 0;
+
+    batch->event_count++;
+    batch->open_note[key] = pos + 1;
+
+    /* it is behind the cursor, played already */
+    if (pos <= track_cursor[track])
+      track_cursor[track]++;
+  }
+}
+
+/* audio thread, ends the notes held on the track recorded to */
+void close_recorded_notes(void)
+{
+  EventBatch *batch = &sequencer_data.track[seq_record_track];
+  int64_t tick = MAX((int64_t)floor(frame_to_tick(seq_block_frame) + 0.5), 0);
+
+  for (int key = 0; key < ARRAY_SIZE(batch->open_note); key++)
+  {
+    if (batch->open_note[key])
+    {
+      Event *event = event_at(batch, batch->open_note[key] - 1);
+      event->duration = (uint32_t)MAX(tick - (int64_t)event->tick, 1);
+      batch->open_note[key] = 0;
+    }
+  }
+}
+
+/* called by the audio thread at the start of a block, after the sequencer */
+void receive_midi(void)
+{
+  spsc_queue *queues[2] = { &midi_gui_queue, &midi_in_queue };
+
+  /* notes held when the recording stopped or moved to another track end
+   * there, a song being loaded has none open */
+  int track = atomic_load(&sequencer_data.record_track);
+  bool record = recording && playing && !seq_tracks_held;
+  if (recording_notes && !seq_tracks_held && (!record || track != seq_record_track))
+    close_recorded_notes();
+  seq_record_track = track;
+  recording_notes = record;
+
+  for (int i = 0; i < ARRAY_SIZE(queues); i++)
+  {
+    MidiMessage m;
+    while (spsc_pop(queues[i], &m))
+    {
+      if (record)
+        record_midi(m.event.frame, m.event.key, m.event.note_on, m.event.velocity);
+
+      deliver_midi(m.inst, m.event);
+    }
+  }
+}
+
+/* may be called from any thread, done at the start of the next block */
+void sequencer_seek(uint32_t tick)
+{
+  seq_seek_tick = tick;
+  atomic_store_explicit(&seq_seek_pending, true, memory_order_release);
+  if (!playing)
+    seq_time = (double)tick / PPQ;
+}
+
+/* play the events of the next nframes of the song, called by the audio
+ * thread once per block, costs only the events inside the block */
+void sequencer_process(int nframes)
+{
+  seq_block_frame = seq_frame;
+
+  TempoMap *map = atomic_load_explicit(&tempo_map, memory_order_acquire);
+  if (!map)
+    return;
+
+  if (map != seq_map)
+  {
+    /* keep the position in ticks over the change */
+    double tick = seq_map ? frame_to_tick(seq_frame) : 0.0;
+    seq_map = map;
+    atomic_store(&tempo_map_in_use, map);
+    seq_segment = 0;
+    set_origin(seq_frame, tick);
+  }
 
-#if 1
-  //printf("processing..\n");
-  for (int i_inst = count - 1; i_inst >= 0; i_inst--)
+  /* the tracks are being replaced, a seek waits for the new ones */
+  if (seq_tracks_held)
   {
-    Instrument *inst = current_seq[i_inst];
-
-    //printf("process %s\n", inst->name);
+    flush_note_offs();
+    return;
+  }
 
-    for (int i = 0; i < inst->num_inputs; i++)
-    {
-      sample_t *buf = inst->inputs[i].target_inst->outputs[inst->inputs[i].target_connection].buffer;
-      inputs[i] = buf ? buf : empty_buffer;
-    }
+  if (atomic_exchange_explicit(&seq_seek_pending, false, memory_order_acquire))
+  {
+    flush_note_offs();
+    set_origin(seq_frame, seq_seek_tick);
+    seq_time = (double)seq_seek_tick / PPQ;
 
-    for (int i = 0; i < inst->num_outputs; i++)
-    {
-      if (!inst->outputs[i].buffer)
-        inst->outputs[i].buffer = allocate_buffer();
+    for (int t = 0; t < NUM_TRACKS; t++)
+      track_cursor[t] = find_event(&sequencer_data.track[t], seq_seek_tick);
+    track_heap_build();
+  }
 
-      sample_t *buf = inst->outputs[i].buffer;
-      outputs[i] = buf ? buf : temp_buffers[i];
-    }
+  /* also while stopped, the display follows tempo edits */
+  seq_segment = segment_at_time((seq_frame - seq_origin_frame) / sample_rate) - seq_map->segments;
+  bpm = seq_map->segments[seq_segment].bpm;
 
-    inst->process_audio(inst, main_frames, (const void **)inputs, (void **)outputs);
+  if (!playing)
+  {
+    flush_note_offs();
+    return;
   }
-#endif
 
-#if 0
-  double *tmp[2];
-  tmp[0] = temp_buffers[0];
-  tmp[1] = temp_buffers[1];
+  /* the events before end_tick are due in this block */
+  int64_t block_end = seq_frame + nframes;
+  int64_t end_tick = first_tick_at(block_end);
 
-  the_rack.first->process_audio(the_rack.first, main_frames, (void **)tmp);
+  while (track_heap_count > 0)
+  {
+    int track = track_heap[0];
+    EventBatch *batch = &sequencer_data.track[track];
+    Event *event = event_at(batch, track_cursor[track]);
 
-  process_reverb(temp_buffers[0], temp_buffers[1], main_output_buffer[0], main_output_buffer[1], main_frames);
-  process_audio_synth(temp_buffers[0], temp_buffers[1], main_frames);
+    if (event->tick >= end_tick)
+      break;
 
-  process_reverb(temp_buffers[0], temp_buffers[1], main_output_buffer[0], main_output_buffer[1], main_frames);
+    /* the track drops out when it has no events left */
+    if (++track_cursor[track] == batch->event_count)
+      track_heap[0] = track_heap[--track_heap_count];
+    track_heap_down(0);
 
-  //process_reverb(main_input_buffer[1], main_input_buffer[1], main_output_buffer[0], main_output_buffer[1], main_frames);
-#endif
-}
+    if (event->type != ET_NOTE)
+      continue;
 
-void record_midi(int key, int note_on, int velocity)
-{
-  int count = sequencer_data.track[0].event_count;
-  if (note_on)
-  {
-    Event *events = sequencer_data.track[0].events;
-    events[count].time_seq = seq_time;
-    events[count].type = ET_NOTE;
-    events[count].val1 = key;
-    events[count].val2 = velocity;
-    events[count].val3 = 0;
-    events[count].duration = 0;
+    Instrument *inst = sequencer_data.track_instrument[track];
 
-    sequencer_data.track[0].event_count++;
-  }
-  else
-  {
-    for (int i = sequencer_data.track[0].event_count - 1; i >= 0; i--)
-    {
-      Event *events = sequencer_data.track[0].events;
+    int frame = (int)MAX(tick_to_frame(event->tick) - seq_frame, 0);
+    sequencer_note(inst, frame, event->val1, 1, event->val2);
 
-      if (events[i].val1 == key && events[i].duration == 0.0)
-      {
-        events[i].duration = seq_time - events[i].time_seq;
-        break;
-      }
-      
+    /* notes still being recorded have no length yet */
+    if (event->duration > 0)
+    {
+      if (note_off_count < ARRAY_SIZE(note_off_heap))
+        note_off_push(tick_to_frame((int64_t)event->tick + event->duration), event->val1, inst);
+      else
+        sequencer_note(inst, frame, event->val1, 0, 0);
     }
   }
-}
 
-void midi_note_play(int key, int note_on, int velocity)
-{
-  if (midi_input_instrument)
+  while (note_off_count > 0 && note_off_heap[0].frame < block_end)
   {
-    if (midi_input_instrument->process_midi)
-      midi_input_instrument->process_midi(midi_input_instrument, key, note_on, velocity);
+    PendingNoteOff off = note_off_pop();
+    sequencer_note(off.inst, (int)MAX(off.frame - seq_frame, 0), off.key, 0, 0);
   }
-}
 
-void midi_user_input(int key, int note_on, int velocity)
-{
-  midi_note_play(key, note_on, velocity);
-
-  if (recording && playing)
-  {
-    record_midi(key, note_on, velocity);
-  }
+  seq_frame = block_end;
+  seq_time = frame_to_tick(seq_frame) / PPQ;
 }
 
-void hw_midi_event_in(int count, const unsigned char *buffer)
+/* frame is the offset of the event inside the current period */
+void hw_midi_event_in(int frame, int count, const unsigned char *buffer)
 {
   if (count == 3)
   {
@@ -474,12 +2522,12 @@ void hw_midi_event_in(int count, const unsigned char *buffer)
     switch (buffer[0])
     {
       case 0x90: /* note on */
-        midi_user_input(key, 1, buffer[2]);
+        midi_note_play(&midi_in_queue, frame, key, 1, buffer[2]);
         gui_keyboard_state[key] = 1;
         redisplay();
         break;
       case 0x80: /* note off */
-        midi_user_input(key, 0, buffer[2]);
+        midi_note_play(&midi_in_queue, frame, key, 0, buffer[2]);
         gui_keyboard_state[key] = 0;
         redisplay();
         break;
@@ -490,63 +2538,30 @@ void hw_midi_event_in(int count, const unsigned char *buffer)
 
 }
 
-int process_callback(jack_nframes_t nframes, void *arg)
+/* called by the backend once per period, MIDI input has been queued
+ * through hw_midi_event_in() before */
+int audio_process_callback(int nframes, float **in, float **out)
 {
-  //printf("process %d frames\n", (int)nframes);
-
-  jack_default_audio_sample_t *out[2];
-  jack_default_audio_sample_t *in[2];
-
-  void *midi = jack_port_get_buffer(input_port_midi, nframes);;
-
-  out[0] = jack_port_get_buffer(output_port_1, nframes);
-  out[1] = jack_port_get_buffer(output_port_2, nframes);
-
-  in[0] = jack_port_get_buffer(input_port[0], nframes);
-  in[1] = jack_port_get_buffer(input_port[1], nframes);
-
-  //printf("callback %p %p %p %p %p\n", out[0], out[1], in[0], in[1], midi);
-
+  if (audio_render_in_callback)
   {
-    jack_midi_event_t event;
-    jack_nframes_t i = 0;
-    jack_nframes_t event_count = jack_midi_get_event_count(midi);
-
-    for (i = 0; i < event_count; i++)
+    /* input of this cycle feeds the output of this cycle */
+    for (int i = 0; i < nframes; i++)
     {
-      jack_midi_event_get(&event, midi, i);
-      printf("Midi event time %d, %zu bytes %02x %02x %02x\n", event.time, event.size, event.buffer[0], event.size > 1 ? event.buffer[1] : 0, event.size > 2 ? event.buffer[2] : 0);
-
-      hw_midi_event_in(event.size, event.buffer);
+      main_input_buffer[0][i] = (double)in[0][i];
+      main_input_buffer[1][i] = (double)in[1][i];
     }
 
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double t = tv.tv_sec + 0.000001 * tv.tv_usec;
-
-    if (playing)
-    {
-      if (t - last_process < 0.5)
-      {
-        Event *events = sequencer_data.track[0].events;
-        double new_seq_time = seq_time + (t - last_process) * (bpm / 60.0);
-        for (int i = 0; i < sequencer_data.track[0].event_count; i++)
-        {
-            printf("checking %d %d %f %f\n", i, events[i].val1, events[i].time_seq, last_process);
-          if (events[i].time_seq >= seq_time && 
-              events[i].time_seq < new_seq_time)
-          {
-            printf("Playing %d %d\n", i, events[i].val1);
-            if (events[i].type = ET_NOTE)
-              midi_note_play(events[i].val1, 1, events[i].val2);
-          }
-        }
+    /* silence in case nothing in the graph writes the outputs */
+    memset(out[0], 0, nframes * sizeof(float));
+    memset(out[1], 0, nframes * sizeof(float));
 
-        seq_time = new_seq_time;
-      }
-      last_process = t;
+    main_output_port[0] = out[0];
+    main_output_port[1] = out[1];
+    process_audio();
+    main_output_port[0] = NULL;
+    main_output_port[1] = NULL;
 
-    }
+    return 0;
   }
 
   /* copy from internal buffer */
@@ -563,357 +2578,517 @@ int process_callback(jack_nframes_t nframes, void *arg)
     //out[1][i] = in[1][i]; 
   }
   //printf("input buffer %f %f\n", main_input_buffer[0][0], main_input_buffer[1][0]);
-  *(volatile int *)&wakeup_audio_thread = 1;
+  sem_post(&audio_thread_wakeup);
 
   return 0;
 }
 
 void init_machines(void)
 {
-  delay1[0] = make_delay_line(4799, 0.742);
-  delay1[1] = make_delay_line(4999, 0.733);
-  delay1[2] = make_delay_line(5399, 0.715);
-  delay1[3] = make_delay_line(5801, 0.697);
-
-  delay1[4] = make_delay_line(1051, 0.7);
-  delay1[5] = make_delay_line(337, 0.7);
-  delay1[6] = make_delay_line(113, 0.7);
-
+  init_tuning();
   init_waveforms();
+  init_oscillator_kernels();
+  printf("Synth oscillators use the %s kernel\n", oscillator_kernel_name);
+  compile_tempo_map();
 }
 
+AudioBackend *audio_backend = &jack_backend;
+
 void init_audio(void)
 {
-  jack_options_t options = JackNullOption;
+  init_machines();
 
-  const char *client_name = JACK_CLIENT_NAME;
-  const char *server_name = NULL;
+  printf("Using the %s audio backend\n", audio_backend->name);
 
-  jack_status_t status;
+  if (audio_backend->open())
+    exit(EXIT_FAILURE);
 
-  client = jack_client_open(client_name, options, &status, server_name);
+  printf("Rendering %s\n", audio_render_in_callback ? "in the process callback" : "on the audio thread");
 
-  if (!client)
-  {
-    fprintf(stderr, "jack_client_open() failed 0x%2.0x\n", status);
-    if (status & JackServerFailed)
-      fprintf(stderr, "Unable to connect to JACK server\n");
+  if (audio_backend->start())
     exit(EXIT_FAILURE);
-  }
 
-  if (status & JackServerStarted)
-    printf("JACK server started\n");
+  printf("init_audio finished.\n");
+}
 
-  if (status & JackNameNotUnique)
-  {
-    client_name = jack_get_client_name(client);
-    printf("New unique name assigned: \"%s\"\n", client_name);
-  }
+void deinit_audio(void)
+{
+  audio_backend->close();
+}
 
-  sample_rate = jack_get_sample_rate(client);
-  printf("Sample rate: %f Hz\n", sample_rate);
+void *audio_thread_func(void *arg)
+{
+  printf("Starting audio thread\n");
 
-  jack_set_buffer_size_callback(client, &audio_buffer_size_callback, NULL);
+  while (1)
+  {
+    /* sleep until the process callback (or start_audio) signals */
+    if (sem_wait(&audio_thread_wakeup) != 0)
+      continue; /* EINTR */
 
-  /* add callback */
-  printf("setting process callback\n");
-  jack_set_process_callback(client, &process_callback, NULL);
+    /* wakeups that piled up while we were late would only render
+     * the same block again, collapse them into one */
+    while (sem_trywait(&audio_thread_wakeup) == 0)
+      ;
 
-  init_machines();
+    switch (audio_thread_state)
+    {
+      case ATS_STARTUP:
+        printf("Init audio\n");
+        init_audio();
+        audio_thread_state = ATS_PROCESSING;
+        break;
+      case ATS_PROCESSING:
+        process_audio();
+        break;
+      case ATS_STOPPED:
+        break;
+    }
+  }
 
-  // jack_on_shutdown(client, &jack_shutdown, 0);
+  return NULL;
+}
 
-  input_port_count = 0;
-  for (int i = 0; i < 2; i++)
-  {
-    char name[20];
-    snprintf(name, sizeof(name), "input_%d", i + 1);
-    jack_port_t *port = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+void start_audio(void)
+{
+  start_audio_workers();
 
-    if (!port)
-    {
-      fprintf(stderr, "Failed to register a port: %s\n", name);
-      exit(EXIT_FAILURE);
-    }
+  sem_init(&audio_thread_wakeup, 0, 1); /* initial count runs ATS_STARTUP */
+  pthread_create(&audio_thread_obj, NULL, &audio_thread_func, NULL);
+}
 
-    input_port[input_port_count++] = port;
-  }
+///////////////////////////////////////////////////////////////////////////////
+// Offline rendering
+///////////////////////////////////////////////////////////////////////////////
 
-  output_port_1 = jack_port_register(client, "output_L", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+#define OFFLINE_BLOCK_SIZE 256
 
-  if (!output_port_1)
-  {
-    fprintf(stderr, "Failed to register an output port\n");
-    exit(EXIT_FAILURE);
-  }
+void write_u16(FILE *f, uint16_t v)
+{
+  uint8_t b[2] = { v & 0xff, v >> 8 };
+  fwrite(b, 1, 2, f);
+}
 
-  output_port_2 = jack_port_register(client, "output_R", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+void write_u32(FILE *f, uint32_t v)
+{
+  uint8_t b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24 };
+  fwrite(b, 1, 4, f);
+}
+
+/* 32 bit float stereo, little endian host assumed for the samples */
+void write_wav_header(FILE *f, int rate, uint32_t frames)
+{
+  uint32_t data_size = frames * 2 * sizeof(float);
+
+  fwrite("RIFF", 1, 4, f);
+  write_u32(f, 4 + (8 + 18) + (8 + 4) + (8 + data_size));
+  fwrite("WAVE", 1, 4, f);
+
+  fwrite("fmt ", 1, 4, f);
+  write_u32(f, 18);
+  write_u16(f, 3); /* WAVE_FORMAT_IEEE_FLOAT */
+  write_u16(f, 2);
+  write_u32(f, rate);
+  write_u32(f, rate * 2 * sizeof(float));
+  write_u16(f, 2 * sizeof(float));
+  write_u16(f, 32);
+  write_u16(f, 0);
+
+  fwrite("fact", 1, 4, f);
+  write_u32(f, 4);
+  write_u32(f, frames);
+
+  fwrite("data", 1, 4, f);
+  write_u32(f, data_size);
+}
 
-  if (!output_port_2)
+/* Render the rack and the song to a WAV file as fast as possible, without
+ * JACK. The sequencer is driven by the rendered sample count. */
+int render_offline(const char *filename, double length)
+{
+  FILE *f = fopen(filename, "wb");
+  if (!f)
   {
-    fprintf(stderr, "Failed to register an output port\n");
-    exit(EXIT_FAILURE);
+    fprintf(stderr, "Can't open \"%s\" for writing\n", filename);
+    return -1;
   }
 
-  input_port_midi = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+  init_machines();
+  start_audio_workers();
+  allocate_main_buffers(OFFLINE_BLOCK_SIZE);
 
-  if (!input_port_midi)
-  {
-    fprintf(stderr, "Failed to register the input midi port\n");
-    exit(EXIT_FAILURE);
-  }
+  uint32_t total_frames = (uint32_t)(length * sample_rate);
+  write_wav_header(f, (int)sample_rate, total_frames);
 
-  if (jack_activate(client))
-  {
-    fprintf(stderr, "Cannot activate client\n");
-    exit(EXIT_FAILURE);
-  }
+  float interleaved[2 * OFFLINE_BLOCK_SIZE];
 
-  /* connect port */
-  const char **ports;
+  sequencer_seek(0);
+  playing = true;
 
-  {
-    ports = jack_get_ports(client, NULL, NULL, JackPortIsPhysical | JackPortIsInput);
-    if (!ports)
-    {
-      fprintf(stderr, "Failed to get physical output ports\n");
-      exit(EXIT_FAILURE);
-    }
+  struct timespec ts_start, ts_end;
+  clock_gettime(CLOCK_MONOTONIC, &ts_start);
 
-    if (jack_connect(client, jack_port_name(output_port_1), ports[0]))
-    {
-      fprintf(stderr, "Failed to connect to physical output ports\n");
-    }
+  uint32_t frames_done = 0;
+  while (frames_done < total_frames)
+  {
+    memset(main_output_buffer[0], 0, main_frames * sizeof(double));
+    memset(main_output_buffer[1], 0, main_frames * sizeof(double));
+    process_audio();
 
-    if (jack_connect(client, jack_port_name(output_port_2), ports[1]))
+    int n = MIN(main_frames, (int)(total_frames - frames_done));
+    for (int i = 0; i < n; i++)
     {
-      fprintf(stderr, "Failed to connect to physical output ports\n");
+      interleaved[2 * i] = (float)main_output_buffer[0][i];
+      interleaved[2 * i + 1] = (float)main_output_buffer[1][i];
     }
+    fwrite(interleaved, sizeof(float), 2 * n, f);
 
-    jack_free(ports);
+    frames_done += n;
   }
 
-  {
-    ports = jack_get_ports(client, NULL, NULL, JackPortIsPhysical | JackPortIsOutput);
-    if (!ports)
-    {
-      fprintf(stderr, "Failed to get physical input ports\n");
-      exit(EXIT_FAILURE);
-    }
+  clock_gettime(CLOCK_MONOTONIC, &ts_end);
 
-    if (ports[0])
-    {
-      if (jack_connect(client, ports[0], jack_port_name(input_port[0])))
-      {
-        fprintf(stderr, "Failed to connect to physical output ports\n");
-      }
-    }
+  playing = false;
+  fclose(f);
 
-    if (ports[1])
-    {
-      if (jack_connect(client, ports[1], jack_port_name(input_port[1])))
-      {
-        fprintf(stderr, "Failed to connect to physical output ports\n");
-      }
-    }
+  double elapsed = (ts_end.tv_sec - ts_start.tv_sec) + 1.0e-9 * (ts_end.tv_nsec - ts_start.tv_nsec);
+  double rendered = total_frames / sample_rate;
 
-    jack_free(ports);
-  }
+  printf("Rendered %.2f s to \"%s\" in %.3f s (%.1fx real time)\n",
+      rendered, filename, elapsed, elapsed > 0.0 ? rendered / elapsed : 0.0);
 
-  ports = jack_get_ports(client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsPhysical|JackPortIsOutput);
-  if (!ports)
-  {
-    fprintf(stderr, "Failed to get physical input ports\n");
-    exit(EXIT_FAILURE);
-  }
+  return 0;
+}
 
-  //printf("port %s\n", ports[0]);
+///////////////////////////////////////////////////////////////////////////////
+// Instrument
+///////////////////////////////////////////////////////////////////////////////
 
-  /* connect to last midi port */
-  const char *s = NULL;
+/* Envelopes advance one sample at a time without divisions: the attack
+ * rises by a fixed step, decay and release approach their target by a fixed
+ * ratio, reaching it within ENVELOPE_FLOOR when the stage ends. Stage times
+ * are taken when the stage is entered. */
+#define ENVELOPE_FLOOR 0.001 /* -60 dB */
 
-  {
-    int i = 0;
-    while (ports[i])
-    {
-      s = ports[i];
-      i++;
-    }
-  }
+void envelope_note_on(envelope *e, double attack, double decay, double sustain)
+{
+  e->stage = ENV_ATTACK;
+  e->frames = MAX(1, (int)(attack * sample_rate));
+  e->step = (1.0 - e->value) / e->frames; /* from the current value, no click on retrigger */
+  e->decay_frames = MAX(1, (int)(decay * sample_rate));
+  e->sustain = sustain;
+}
+
+void envelope_note_off(envelope *e, double release)
+{
+  if (e->stage == ENV_IDLE || e->stage == ENV_RELEASE)
+    return;
 
-  if (s)
+  e->stage = ENV_RELEASE;
+  e->frames = MAX(1, (int)(release * sample_rate));
+  e->target = 0.0;
+  e->multiplier = pow(ENVELOPE_FLOOR, 1.0 / e->frames);
+}
+
+static inline double envelope_next(envelope *e)
+{
+  switch (e->stage)
   {
-    if (jack_connect(client, s, jack_port_name(input_port_midi)))
-    {
-      fprintf(stderr, "Failed to connect to midi port\n");
-    }
+    case ENV_ATTACK:
+      e->value += e->step;
+      if (--e->frames == 0)
+      {
+        e->value = 1.0;
+        e->stage = ENV_DECAY;
+        e->frames = e->decay_frames;
+        e->target = e->sustain;
+        e->multiplier = pow(ENVELOPE_FLOOR, 1.0 / e->frames);
+      }
+      break;
+    case ENV_DECAY:
+    case ENV_RELEASE:
+      e->value = e->target + (e->value - e->target) * e->multiplier;
+      if (--e->frames == 0)
+      {
+        e->value = e->target;
+        e->stage = e->stage == ENV_DECAY ? ENV_SUSTAIN : ENV_IDLE;
+      }
+      break;
   }
 
-  jack_free(ports);
-
-  printf("init_audio finished.\n");
+  return e->value;
 }
 
-void deinit_audio(void)
+void init_synth_voices(struct synth_data *data)
 {
-  if (client)
+  for (int i = 0; i < MAX_SYNTH_POLYPHONY; i++)
   {
-    jack_client_close(client);
-    client = NULL;
+    data->note[i] = -1;
+    data->free_voices[i] = MAX_SYNTH_POLYPHONY - 1 - i;
   }
-}
+  data->free_count = MAX_SYNTH_POLYPHONY;
+  data->active_count = 0;
 
+  data->pitch_inputs[0] = NAN; /* computed by the first block */
+  data->pitch_serial = 0;
+}
 
-void *audio_thread_func(void *arg)
+static void synth_voice_free(struct synth_data *data, int voice)
 {
-  printf("Starting audio thread\n");
-  wakeup_audio_thread = 1;
+  int index = data->active_index[voice];
+  int last = data->active[--data->active_count];
+  data->active[index] = last;
+  data->active_index[last] = index;
+
+  /* the filter state moves with the voice, the padding lane is silent */
+  data->filter_ic1[index] = data->filter_ic1[data->active_count];
+  data->filter_ic2[index] = data->filter_ic2[data->active_count];
+  data->filter_ic1[data->active_count] = 0.0;
+  data->filter_ic2[data->active_count] = 0.0;
+
+  if (data->key_voice[data->note[voice]] == voice + 1)
+    data->key_voice[data->note[voice]] = 0;
+  data->note[voice] = -1;
+  data->free_voices[data->free_count++] = voice;
+}
 
-  while (1)
+/* only when the polyphony is used up, prefers voices already released */
+static int synth_voice_steal(struct synth_data *data, int policy)
+{
+  int best = data->active[0];
+  for (int k = 1; k < data->active_count; k++)
   {
-    if (*(volatile int *)&wakeup_audio_thread == 1)
-    {
-      *(volatile int *)&wakeup_audio_thread = 0;
-      switch (audio_thread_state)
-      {
-        case ATS_STARTUP:
-          printf("Init audio\n");
-          init_audio();
-          audio_thread_state = ATS_PROCESSING;
-          break;
-        case ATS_PROCESSING:
-          process_audio();
-          break;
-        case ATS_STOPPED:
-          break;
-      }
-    }
-    else
+    int v = data->active[k];
+    bool released = data->env[v].stage == ENV_RELEASE;
+    bool best_released = data->env[best].stage == ENV_RELEASE;
+
+    if (released != best_released)
     {
+      if (released)
+        best = v;
     }
+    else if (policy == VOICE_STEAL_QUIETEST ? data->env[v].value < data->env[best].value :
+        data->started[v] - data->started[best] > UINT32_MAX / 2 /* older, wraps */)
+      best = v;
   }
 
-  return NULL;
-}
-
-void start_audio(void)
-{
-  pthread_create(&audio_thread_obj, NULL, &audio_thread_func, NULL);
+  return best;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// Instrument
-///////////////////////////////////////////////////////////////////////////////
-
 void process_midi_synth(Instrument *inst, int key, int note_on, int velocity)
 {
   struct synth_data *data = (struct synth_data *)inst->specific_data;
 
-  for (int i = 0; i < MAX_SYNTH_POLYPHONY; i++)
+  Param *params = inst->params;
+
+  int voice = data->key_voice[key] - 1;
+
+  if (!note_on)
   {
-    if (note_on)
-    {
-      if (data->note[i] == -1)
-      {
-        data->note[i] = key;
-        break;
-      }
-    }
-    else
-    {
-      if (data->note[i] == key)
-      {
-        data->note[i] = -1;
-        break;
-      }
-    }
+    /* the voice is freed when the release has finished */
+    if (voice >= 0)
+      envelope_note_off(&data->env[voice], params[SYNTH_RELEASE].value);
+    return;
+  }
+
+  /* not mapped in the tuning */
+  if (key_to_frequency(key) == 0.0)
+    return;
+
+  int policy = (int)params[SYNTH_VOICE_STEAL].value;
+  int polyphony = (int)params[SYNTH_POLYPHONY].value;
+
+  if (voice >= 0 && policy != VOICE_STEAL_RETRIGGER)
+  {
+    /* a repeated note-on without a note-off, the new voice takes the key */
+    envelope_note_off(&data->env[voice], params[SYNTH_RELEASE].value);
+    voice = -1;
+  }
+
+  if (voice < 0 && (data->active_count >= polyphony || data->free_count == 0))
+  {
+    voice = synth_voice_steal(data, policy);
+    if (data->key_voice[data->note[voice]] == voice + 1)
+      data->key_voice[data->note[voice]] = 0;
+  }
+
+  if (voice < 0)
+  {
+    voice = data->free_voices[--data->free_count];
+    data->active_index[voice] = data->active_count;
+    data->active[data->active_count++] = voice;
   }
+
+  /* a taken over voice continues from its level */
+  data->note[voice] = key;
+  data->key_voice[key] = voice + 1;
+  data->voice_pitch_serial[voice] = data->pitch_serial - 1;
+  data->started[voice] = data->note_on_count++;
+  envelope_note_on(&data->env[voice], params[SYNTH_ATTACK].value, params[SYNTH_DECAY].value, params[SYNTH_SUSTAIN].value);
 }
 
 void process_audio_synth(Instrument *inst, int nframes, const void **inputs, void **outputs)
 {
-  static double last_y = 0.0;
   double *output_l = (double *)outputs[0];
   double *output_r = (double *)outputs[1];
 
   struct synth_data *data = (struct synth_data *)inst->specific_data;
 
-  double volume = inst->sliders[SYNTH_VOLUME].value;
-  double filter_cutoff = inst->sliders[SYNTH_FILTER_CUTOFF].value;
-
-  int osc1_shape = (int)inst->sliders[SYNTH_OSC1_SHAPE].value;
-  int osc2_shape = (int)inst->sliders[SYNTH_OSC2_SHAPE].value;
-  int osc3_shape = (int)inst->sliders[SYNTH_OSC3_SHAPE].value;
+  Param *params = inst->params;
 
-  double osc_volume[3] = { (1.0 - inst->sliders[SYNTH_OSC1_OSC2_VOLUME_RATIO].value) * (1.0 - inst->sliders[SYNTH_OSC3_VOLUME_RATIO].value),
-    inst->sliders[SYNTH_OSC1_OSC2_VOLUME_RATIO].value * (1.0 - inst->sliders[SYNTH_OSC3_VOLUME_RATIO].value),
-    inst->sliders[SYNTH_OSC3_VOLUME_RATIO].value };
+  int osc1_shape = (int)params[SYNTH_OSC1_SHAPE].value;
+  int osc2_shape = (int)params[SYNTH_OSC2_SHAPE].value;
+  int osc3_shape = (int)params[SYNTH_OSC3_SHAPE].value;
 
-  double freq_modifiers[3] = { 
-    powf(2.0f, inst->sliders[SYNTH_OSC1_OCTAVE].value + inst->sliders[SYNTH_OSC1_SEMITONE].value / 12.0 + 
-        inst->sliders[SYNTH_OSC1_DETUNE].value / 100.0 / 12.0),
-    powf(2.0f, inst->sliders[SYNTH_OSC2_OCTAVE].value + inst->sliders[SYNTH_OSC2_SEMITONE].value / 12.0 + 
-        inst->sliders[SYNTH_OSC2_DETUNE].value / 100.0 / 12.0),
-    powf(2.0f, inst->sliders[SYNTH_OSC3_OCTAVE].value + inst->sliders[SYNTH_OSC3_SEMITONE].value / 12.0 + 
-        inst->sliders[SYNTH_OSC3_DETUNE].value / 100.0 / 12.0),
+  /* pitch is followed per block, the increments are only recomputed when it changed */
+  double pitch_inputs[ARRAY_SIZE(data->pitch_inputs)] = {
+    params[SYNTH_OSC1_OCTAVE].value, params[SYNTH_OSC1_SEMITONE].value, param_block(&params[SYNTH_OSC1_DETUNE], nframes),
+    params[SYNTH_OSC2_OCTAVE].value, params[SYNTH_OSC2_SEMITONE].value, param_block(&params[SYNTH_OSC2_DETUNE], nframes),
+    params[SYNTH_OSC3_OCTAVE].value, params[SYNTH_OSC3_SEMITONE].value, param_block(&params[SYNTH_OSC3_DETUNE], nframes),
+    params[SYNTH_OSC1_VOICES].value, param_block(&params[SYNTH_OSC1_VOICES_DETUNE], nframes), sample_rate,
+    atomic_load(&tuning_serial)
   };
 
-  int detune_voices = (int)inst->sliders[SYNTH_OSC1_VOICES].value;
-  double detune_voices_amount = inst->sliders[SYNTH_OSC1_VOICES_DETUNE].value;
+  int detune_voices = (int)params[SYNTH_OSC1_VOICES].value;
 
-  double *shapes[3] = { get_waveform(osc1_shape), get_waveform(osc2_shape), get_waveform(osc3_shape) };
+  if (memcmp(pitch_inputs, data->pitch_inputs, sizeof(pitch_inputs)))
+  {
+    memcpy(data->pitch_inputs, pitch_inputs, sizeof(pitch_inputs));
 
-  volume *= 1.0 / detune_voices * (1.0 + (detune_voices - 1) * 0.15);
+    for (int i_osc = 0; i_osc < 3; i_osc++)
+      data->freq_modifier[i_osc] = powf(2.0f, pitch_inputs[3 * i_osc] + pitch_inputs[3 * i_osc + 1] / 12.0 +
+          pitch_inputs[3 * i_osc + 2] / 100.0 / 12.0);
 
-  double a = (2 * M_PI * filter_cutoff / sample_rate) /
-    (2 * M_PI * filter_cutoff / sample_rate + 1);
+    double detune_voices_amount = pitch_inputs[10];
+    for (int j = 0; j < detune_voices; j++)
+      data->unison_ratio[j] = powf(2.0f,
+          ((j - detune_voices / 2.0 + 0.5) / (detune_voices > 1 ? (detune_voices / 2.0 - 0.5) : 1.0)) * detune_voices_amount / 100.0 / 12.0);
 
-  for (int i = 0; i < MAX_SYNTH_POLYPHONY; i++)
+    data->pitch_serial++;
+  }
+
+  int shapes[3] = { osc1_shape, osc2_shape, osc3_shape };
+
+  double voices_gain = 1.0 / detune_voices * (1.0 + (detune_voices - 1) * 0.15);
+
+  Param *ratio12 = &params[SYNTH_OSC1_OSC2_VOLUME_RATIO];
+  Param *ratio3 = &params[SYNTH_OSC3_VOLUME_RATIO];
+  Param *cutoff = &params[SYNTH_FILTER_CUTOFF];
+  Param *resonance = &params[SYNTH_FILTER_RESONANCE];
+  Param *env_amount = &params[SYNTH_FILTER_ENV_AMOUNT];
+  double osc_volume[3] = { 0 };
+
+  /* new notes and all notes after a pitch change; pitch modulation would
+   * scale these increments rather than recompute them */
+  for (int k = 0; k < data->active_count; k++)
   {
-    if (data->note[i] != -1)
+    int i = data->active[k];
+    if (data->voice_pitch_serial[i] == data->pitch_serial)
+      continue;
+    data->voice_pitch_serial[i] = data->pitch_serial;
+
+    for (int i_osc = 0; i_osc < 3; i_osc++)
     {
-      for (int i_osc = 0; i_osc < 3; i_osc++)
-      {
-          for (int j = 0; j < detune_voices; j++)
-          {
-            double f = freq_modifiers[i_osc] * key_to_frequency(data->note[i]) * powf(2.0f,
-                ((j - detune_voices / 2.0 + 0.5) / (detune_voices > 1 ? (detune_voices / 2.0 - 0.5) : 1.0)) * detune_voices_amount / 100.0 / 12.0);
-            //printf("note %d %d: freq %f (%d)\n", i, data->note[i], f, j);
-            data->phase_delta[i][i_osc][j] = (uint32_t)(f / sample_rate * WAVEFORM_LENGTH * WAVEFORM_FIXED_MULTIPLIER);
-          }
-      }
+        uint32_t highest = 0;
+        for (int j = 0; j < detune_voices; j++)
+        {
+          double f = data->freq_modifier[i_osc] * key_to_frequency(data->note[i]) * data->unison_ratio[j];
+          //printf("note %d %d: freq %f (%d)\n", i, data->note[i], f, j);
+          data->phase_delta[i][i_osc][j] = (uint32_t)(f / sample_rate * WAVEFORM_LENGTH * WAVEFORM_FIXED_MULTIPLIER);
+          highest = MAX(highest, data->phase_delta[i][i_osc][j]);
+        }
+        data->mip_level[i][i_osc] = waveform_mip_level(highest);
     }
   }
 
-  while (nframes--)
+  /* oscillators are rendered a run of frames at a time, see render_oscillators */
+  for (int start = 0; start < nframes; start += SYNTH_RUN_FRAMES)
   {
-    double o = 0.0f;
-    for (int i = 0; i < MAX_SYNTH_POLYPHONY; i++)
+    int count = MIN(SYNTH_RUN_FRAMES, nframes - start);
+    double osc_gain[3][SYNTH_RUN_FRAMES];
+
+    for (int n = 0; n < count; n++)
+    {
+      if (start + n == 0 || ratio12->ramp_frames > 0 || ratio3->ramp_frames > 0)
+      {
+        double r12 = param_next(ratio12);
+        double r3 = param_next(ratio3);
+        osc_volume[0] = (1.0 - r12) * (1.0 - r3);
+        osc_volume[1] = r12 * (1.0 - r3);
+        osc_volume[2] = r3;
+      }
+
+      for (int i_osc = 0; i_osc < 3; i_osc++)
+        osc_gain[i_osc][n] = osc_volume[i_osc];
+    }
+
+    /* filter coefficients follow the cutoff and the voice's envelope a run at a time */
+    double filter_cutoff = param_block(cutoff, count);
+    double filter_k = 2.0 - 1.96 * param_block(resonance, count); /* 1 / Q, from 0.5 to 25 */
+    double filter_env = param_block(env_amount, count);
+    int filter_lanes = (data->active_count + 3) & ~3;
+    double a1[MAX_SYNTH_POLYPHONY];
+    double a2[MAX_SYNTH_POLYPHONY];
+    double a3[MAX_SYNTH_POLYPHONY];
+
+    for (int k = 0; k < data->active_count; k++)
     {
-      if (data->note[i] != -1)
+      int i = data->active[k];
+      double osc_out[3][SYNTH_RUN_FRAMES] = { 0 };
+
+      for (int i_osc = 0; i_osc < 3; i_osc++)
+      {
+        if (shapes[i_osc] >= SYNTH_SHAPE_BLEP)
+          render_blep(shapes[i_osc] - SYNTH_SHAPE_BLEP, data->phase[i][i_osc], data->phase_delta[i][i_osc], detune_voices, osc_out[i_osc], count);
+        else
+          render_oscillators(get_waveform(shapes[i_osc], data->mip_level[i][i_osc]), data->phase[i][i_osc], data->phase_delta[i][i_osc], detune_voices, osc_out[i_osc], count);
+      }
+
+      double fc = filter_cutoff * exp2(filter_env * data->env[i].value);
+      double g = tan(M_PI * MIN(MAX(fc, 10.0), 0.45 * sample_rate) / sample_rate);
+      a1[k] = 1.0 / (1.0 + g * (g + filter_k));
+      a2[k] = g * a1[k];
+      a3[k] = g * a2[k];
+
+      for (int n = 0; n < count; n++)
       {
+        double voice = 0.0;
         for (int i_osc = 0; i_osc < 3; i_osc++)
-        {
-          double val_osc = 0.0;
-          for (int j = 0; j < detune_voices; j++)
-          {
-            val_osc += interp_waveform(shapes[i_osc], WAVEFORM_LENGTH - 1, data->phase[i][i_osc][j]);
-            data->phase[i][i_osc][j] += data->phase_delta[i][i_osc][j];
-          }
-          o += osc_volume[i_osc] * val_osc;
-        }
+          voice += osc_gain[i_osc][n] * osc_out[i_osc][n];
+        data->filter_buffer[n][k] = envelope_next(&data->env[i]) * voice;
       }
     }
 
-    /* low pass filter */
-    double val = a * o + (1.0 - a) * last_y;
-    last_y = val;
+    for (int k = data->active_count; k < filter_lanes; k++)
+    {
+      a1[k] = a2[k] = a3[k] = 0.0;
+      for (int n = 0; n < count; n++)
+        data->filter_buffer[n][k] = 0.0;
+    }
+
+    filter_voices(data->filter_ic1, data->filter_ic2, a1, a2, a3, data->filter_buffer, filter_lanes, count);
 
-    output_l[0] = volume * val;
-    output_r[0] = volume * val;
+    for (int n = 0; n < count; n++)
+    {
+      double volume = param_next(&params[SYNTH_VOLUME]) * voices_gain;
 
-    output_l += 1;
-    output_r += 1;
+      double val = 0.0;
+      for (int k = 0; k < data->active_count; k++)
+        val += data->filter_buffer[n][k];
+
+      output_l[0] = volume * val;
+      output_r[0] = volume * val;
+
+      output_l += 1;
+      output_r += 1;
+    }
+  }
+
+  /* finished releases */
+  for (int k = data->active_count - 1; k >= 0; k--)
+  {
+    if (data->env[data->active[k]].stage == ENV_IDLE)
+      synth_voice_free(data, data->active[k]);
   }
 }
 
@@ -956,7 +3131,23 @@ double process_delay_line_allpass(delay_line_t *l, double sample)
   return y;
 }
 
-void process_reverb(double *input_l, double *input_r, double *output_l, double *output_r, int nframes, double mix)
+reverb_t *make_reverb(void)
+{
+  reverb_t *r = (reverb_t *)calloc(1, sizeof(reverb_t));
+
+  r->delay[0] = make_delay_line(4799, 0.742);
+  r->delay[1] = make_delay_line(4999, 0.733);
+  r->delay[2] = make_delay_line(5399, 0.715);
+  r->delay[3] = make_delay_line(5801, 0.697);
+
+  r->delay[4] = make_delay_line(1051, 0.7);
+  r->delay[5] = make_delay_line(337, 0.7);
+  r->delay[6] = make_delay_line(113, 0.7);
+
+  return r;
+}
+
+void process_reverb(reverb_t *r, double *input_l, double *input_r, double *output_l, double *output_r, int nframes, Param *mix_param)
 {
   for (int i = 0; i < nframes; i++)
   {
@@ -964,20 +3155,21 @@ void process_reverb(double *input_l, double *input_r, double *output_l, double *
     double y = sample;
 
     //printf("out [%03d] %2.6f %2.6f \n", i, y, y2);
-    y = process_delay_line_allpass(delay1[4], y);
-    y = process_delay_line_allpass(delay1[5], y);
-    y = process_delay_line_allpass(delay1[6], y);
+    y = process_delay_line_allpass(r->delay[4], y);
+    y = process_delay_line_allpass(r->delay[5], y);
+    y = process_delay_line_allpass(r->delay[6], y);
 
 
-    double x1 = process_delay_line_comb(delay1[0], y);
-    double x2 = process_delay_line_comb(delay1[1], y);
-    double x3 = process_delay_line_comb(delay1[2], y);
-    double x4 = process_delay_line_comb(delay1[3], y);
+    double x1 = process_delay_line_comb(r->delay[0], y);
+    double x2 = process_delay_line_comb(r->delay[1], y);
+    double x3 = process_delay_line_comb(r->delay[2], y);
+    double x4 = process_delay_line_comb(r->delay[3], y);
 
-    double l = x1 + x2 + x3 + x4;
-    double r = x1 + x3 - x2 - x4;
-    output_l[i] = (1.0 - mix) * sample + mix * l;
-    output_r[i] = (1.0 - mix) * sample + mix * r;
+    double wet_l = x1 + x2 + x3 + x4;
+    double wet_r = x1 + x3 - x2 - x4;
+    double mix = param_next(mix_param);
+    output_l[i] = (1.0 - mix) * sample + mix * wet_l;
+    output_r[i] = (1.0 - mix) * sample + mix * wet_r;
     /*
     output_l[i] = x1;
     output_r[i] = x3;
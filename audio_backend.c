@@ -0,0 +1,462 @@
+/*
+ * audio_backend.c
+ *
+ * Audio backends driving the engine in audio.c
+ *
+ * Initial date: 2026-10-16
+ *
+ * Public domain.
+ */
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// JACK backend
+///////////////////////////////////////////////////////////////////////////////
+
+#define JACK_CLIENT_NAME "Audio Studio"
+
+jack_port_t *input_port[2];
+int input_port_count;
+jack_port_t *input_port_midi;
+jack_port_t *output_port_1;
+jack_port_t *output_port_2;
+jack_client_t *client;
+
+int jack_process_callback(jack_nframes_t nframes, void *arg)
+{
+  //printf("process %d frames\n", (int)nframes);
+
+  jack_default_audio_sample_t *out[2];
+  jack_default_audio_sample_t *in[2];
+
+  void *midi = jack_port_get_buffer(input_port_midi, nframes);;
+
+  out[0] = jack_port_get_buffer(output_port_1, nframes);
+  out[1] = jack_port_get_buffer(output_port_2, nframes);
+
+  in[0] = jack_port_get_buffer(input_port[0], nframes);
+  in[1] = jack_port_get_buffer(input_port[1], nframes);
+
+  //printf("callback %p %p %p %p %p\n", out[0], out[1], in[0], in[1], midi);
+
+  {
+    jack_midi_event_t event;
+    jack_nframes_t i = 0;
+    jack_nframes_t event_count = jack_midi_get_event_count(midi);
+
+    for (i = 0; i < event_count; i++)
+    {
+      jack_midi_event_get(&event, midi, i);
+
+      hw_midi_event_in(event.time, event.size, event.buffer);
+    }
+  }
+
+  return audio_process_callback(nframes, in, out);
+}
+
+int jack_buffer_size_callback(jack_nframes_t nframes, void *arg)
+{
+  audio_buffer_size_callback((int)nframes);
+
+  return 0;
+}
+
+int jack_sample_rate_callback(jack_nframes_t nframes, void *arg)
+{
+  audio_sample_rate_callback((double)nframes);
+
+  return 0;
+}
+
+void jack_latency_callback(jack_latency_callback_mode_t mode, void *arg)
+{
+  /* the decoupled mode plays back the block rendered one period ago */
+  jack_nframes_t extra = audio_render_in_callback ? 0 : (jack_nframes_t)main_frames;
+  jack_latency_range_t range;
+
+  if (mode == JackCaptureLatency)
+  {
+    jack_port_get_latency_range(input_port[0], mode, &range);
+    range.min += extra;
+    range.max += extra;
+    jack_port_set_latency_range(output_port_1, mode, &range);
+    jack_port_set_latency_range(output_port_2, mode, &range);
+  }
+  else
+  {
+    jack_port_get_latency_range(output_port_1, mode, &range);
+    range.min += extra;
+    range.max += extra;
+    for (int i = 0; i < input_port_count; i++)
+      jack_port_set_latency_range(input_port[i], mode, &range);
+  }
+}
+
+int jack_backend_open(void)
+{
+  jack_options_t options = JackNullOption;
+
+  const char *client_name = JACK_CLIENT_NAME;
+  const char *server_name = NULL;
+
+  jack_status_t status;
+
+  client = jack_client_open(client_name, options, &status, server_name);
+
+  if (!client)
+  {
+    fprintf(stderr, "jack_client_open() failed 0x%2.0x\n", status);
+    if (status & JackServerFailed)
+      fprintf(stderr, "Unable to connect to JACK server\n");
+    return -1;
+  }
+
+  if (status & JackServerStarted)
+    printf("JACK server started\n");
+
+  if (status & JackNameNotUnique)
+  {
+    client_name = jack_get_client_name(client);
+    printf("New unique name assigned: \"%s\"\n", client_name);
+  }
+
+  audio_sample_rate_callback(jack_get_sample_rate(client));
+
+  jack_set_buffer_size_callback(client, &jack_buffer_size_callback, NULL);
+  jack_set_sample_rate_callback(client, &jack_sample_rate_callback, NULL);
+
+  /* add callback */
+  printf("setting process callback\n");
+  jack_set_process_callback(client, &jack_process_callback, NULL);
+  jack_set_latency_callback(client, &jack_latency_callback, NULL);
+
+  // jack_on_shutdown(client, &jack_shutdown, 0);
+
+  input_port_count = 0;
+  for (int i = 0; i < 2; i++)
+  {
+    char name[20];
+    snprintf(name, sizeof(name), "input_%d", i + 1);
+    jack_port_t *port = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+
+    if (!port)
+    {
+      fprintf(stderr, "Failed to register a port: %s\n", name);
+      return -1;
+    }
+
+    input_port[input_port_count++] = port;
+  }
+
+  output_port_1 = jack_port_register(client, "output_L", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+
+  if (!output_port_1)
+  {
+    fprintf(stderr, "Failed to register an output port\n");
+    return -1;
+  }
+
+  output_port_2 = jack_port_register(client, "output_R", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+
+  if (!output_port_2)
+  {
+    fprintf(stderr, "Failed to register an output port\n");
+    return -1;
+  }
+
+  input_port_midi = jack_port_register(client, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+
+  if (!input_port_midi)
+  {
+    fprintf(stderr, "Failed to register the input midi port\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+int jack_backend_start(void)
+{
+  if (jack_activate(client))
+  {
+    fprintf(stderr, "Cannot activate client\n");
+    return -1;
+  }
+
+  /* connect port */
+  const char **ports;
+
+  {
+    ports = jack_get_ports(client, NULL, NULL, JackPortIsPhysical | JackPortIsInput);
+    if (!ports)
+    {
+      fprintf(stderr, "Failed to get physical output ports\n");
+      return -1;
+    }
+
+    if (jack_connect(client, jack_port_name(output_port_1), ports[0]))
+    {
+      fprintf(stderr, "Failed to connect to physical output ports\n");
+    }
+
+    if (jack_connect(client, jack_port_name(output_port_2), ports[1]))
+    {
+      fprintf(stderr, "Failed to connect to physical output ports\n");
+    }
+
+    jack_free(ports);
+  }
+
+  {
+    ports = jack_get_ports(client, NULL, NULL, JackPortIsPhysical | JackPortIsOutput);
+    if (!ports)
+    {
+      fprintf(stderr, "Failed to get physical input ports\n");
+      return -1;
+    }
+
+    if (ports[0])
+    {
+      if (jack_connect(client, ports[0], jack_port_name(input_port[0])))
+      {
+        fprintf(stderr, "Failed to connect to physical output ports\n");
+      }
+    }
+
+    if (ports[1])
+    {
+      if (jack_connect(client, ports[1], jack_port_name(input_port[1])))
+      {
+        fprintf(stderr, "Failed to connect to physical output ports\n");
+      }
+    }
+
+    jack_free(ports);
+  }
+
+  ports = jack_get_ports(client, NULL, JACK_DEFAULT_MIDI_TYPE, JackPortIsPhysical|JackPortIsOutput);
+  if (!ports)
+  {
+    fprintf(stderr, "Failed to get physical input ports\n");
+    return -1;
+  }
+
+  //printf("port %s\n", ports[0]);
+
+  /* connect to last midi port */
+  const char *s = NULL;
+
+  {
+    int i = 0;
+    while (ports[i])
+    {
+      s = ports[i];
+      i++;
+    }
+  }
+
+  if (s)
+  {
+    if (jack_connect(client, s, jack_port_name(input_port_midi)))
+    {
+      fprintf(stderr, "Failed to connect to midi port\n");
+    }
+  }
+
+  jack_free(ports);
+
+  return 0;
+}
+
+void jack_backend_close(void)
+{
+  if (client)
+  {
+    jack_client_close(client);
+    client = NULL;
+  }
+}
+
+AudioBackend jack_backend = {
+  .name = "jack",
+  .open = &jack_backend_open,
+  .start = &jack_backend_start,
+  .close = &jack_backend_close,
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Null backend
+///////////////////////////////////////////////////////////////////////////////
+
+/* Calls the engine at exact period boundaries of a simulated device, input is
+ * silence and output is discarded. Used to soak-test and benchmark the
+ * real-time path on machines without an audio server. */
+
+int null_backend_period = 256;
+double null_backend_rate = 48000.0;
+
+pthread_t null_thread;
+volatile bool null_running;
+float *null_buffers[4];
+
+struct {
+  uint64_t periods;
+  uint64_t late; /* processing finished after the next period was due */
+  uint64_t skipped; /* whole periods dropped to catch up */
+  double max_process; /* s */
+  double max_jitter; /* wakeup after the deadline, s */
+  double total_process;
+} null_stats;
+
+double timespec_to_sec(const struct timespec *ts)
+{
+  return ts->tv_sec + 1.0e-9 * ts->tv_nsec;
+}
+
+void sec_to_timespec(double t, struct timespec *ts)
+{
+  ts->tv_sec = (time_t)t;
+  ts->tv_nsec = (long)((t - ts->tv_sec) * 1.0e9);
+}
+
+void *null_backend_thread_func(void *arg)
+{
+  float *in[2] = { null_buffers[0], null_buffers[1] };
+  float *out[2] = { null_buffers[2], null_buffers[3] };
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double start = timespec_to_sec(&ts);
+
+  /* deadlines are computed from the period index, not accumulated */
+  double period = null_backend_period / null_backend_rate;
+  uint64_t index = 0;
+
+  while (null_running)
+  {
+    index++;
+    double deadline = start + index * period;
+
+    sec_to_timespec(deadline, &ts);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double woke = timespec_to_sec(&ts);
+
+    audio_process_callback(null_backend_period, in, out);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double done = timespec_to_sec(&ts);
+
+    null_stats.periods++;
+    null_stats.total_process += done - woke;
+    null_stats.max_process = MAX(null_stats.max_process, done - woke);
+    null_stats.max_jitter = MAX(null_stats.max_jitter, woke - deadline);
+
+    if (done > deadline + period)
+    {
+      null_stats.late++;
+
+      /* more than a period behind, skip ahead instead of bursting */
+      uint64_t behind = (uint64_t)((done - start) / period) - index;
+      if (behind > 0)
+      {
+        null_stats.skipped += behind;
+        index += behind;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+int null_backend_open(void)
+{
+  if (null_backend_period <= 0 || null_backend_rate <= 0.0)
+  {
+    fprintf(stderr, "Invalid null backend period %d or rate %f\n", null_backend_period, null_backend_rate);
+    return -1;
+  }
+
+  /* the statistics time the rendering, which the decoupled mode would
+   * leave to the audio thread */
+  audio_render_in_callback = true;
+
+  audio_sample_rate_callback(null_backend_rate);
+  audio_buffer_size_callback(null_backend_period);
+
+  for (int i = 0; i < ARRAY_SIZE(null_buffers); i++)
+    null_buffers[i] = (float *)calloc(null_backend_period, sizeof(float));
+
+  memset(&null_stats, 0, sizeof(null_stats));
+
+  return 0;
+}
+
+int null_backend_start(void)
+{
+  null_running = true;
+
+  if (pthread_create(&null_thread, NULL, &null_backend_thread_func, NULL))
+  {
+    fprintf(stderr, "Failed to start the null backend thread\n");
+    null_running = false;
+    return -1;
+  }
+
+  /* best effort, needs rtprio permissions */
+  struct sched_param param = { .sched_priority = 70 };
+  if (pthread_setschedparam(null_thread, SCHED_FIFO, &param))
+    printf("Null backend runs without real-time priority\n");
+
+  return 0;
+}
+
+void null_backend_close(void)
+{
+  if (!null_running)
+    return;
+
+  null_running = false;
+  pthread_join(null_thread, NULL);
+
+  double period = null_backend_period / null_backend_rate;
+
+  printf("Null backend: %llu periods of %d frames at %.0f Hz, %llu late, %llu skipped\n",
+      (unsigned long long)null_stats.periods, null_backend_period, null_backend_rate,
+      (unsigned long long)null_stats.late, (unsigned long long)null_stats.skipped);
+  if (null_stats.periods > 0)
+    printf("Null backend: process avg %.1f us max %.1f us (period %.1f us), max wakeup jitter %.1f us\n",
+        1.0e6 * null_stats.total_process / null_stats.periods, 1.0e6 * null_stats.max_process,
+        1.0e6 * period, 1.0e6 * null_stats.max_jitter);
+
+  for (int i = 0; i < ARRAY_SIZE(null_buffers); i++)
+  {
+    free(null_buffers[i]);
+    null_buffers[i] = NULL;
+  }
+}
+
+AudioBackend null_backend = {
+  .name = "null",
+  .open = &null_backend_open,
+  .start = &null_backend_start,
+  .close = &null_backend_close,
+};
+
+AudioBackend *audio_backends[] = { &jack_backend, &null_backend };
+
+AudioBackend *find_audio_backend(const char *name)
+{
+  for (int i = 0; i < ARRAY_SIZE(audio_backends); i++)
+  {
+    if (!strcmp(audio_backends[i]->name, name))
+      return audio_backends[i];
+  }
+
+  return NULL;
+}
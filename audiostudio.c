@@ -8,6 +8,8 @@
  * Public domain.
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+
 #include <sys/time.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -32,6 +34,8 @@
 
 #include "audiostudio.h"
 #include "audio.c"
+#include "audio_backend.c"
+#include "song_file.c"
 
 #define VERSION_MAJOR 0
 #define VERSION_MINOR 1
@@ -50,6 +54,8 @@ enum {
   TRANSPORT_LOAD,
   TRANSPORT_SAVE,
   SEQUENCER_BPM,
+  SEQUENCER_TRACK,
+  SEQUENCER_TRACK_INSTRUMENT,
   TRANSPORT_SLIDER_COUNT
 };
 
@@ -448,7 +454,21 @@ int render_font_texture(int idx_font, const char *font_file, int font_size_px)
 
 void print_usage(const char *exe)
 {
-  fprintf(stderr, "Usage: %s [OPTION]\n", exe);
+  fprintf(stderr, "Usage: %s [OPTION] [SONG]\n", exe);
+  fprintf(stderr, "  -o, --render FILE  render the song to a WAV file without GUI or JACK and exit\n");
+  fprintf(stderr, "  -l, --length SEC   length of the offline render in seconds (default 10)\n");
+  fprintf(stderr, "  -b, --backend NAME audio backend: jack (default) or null\n");
+  fprintf(stderr, "  -p, --period N     period size in frames of the null backend (default 256)\n");
+  fprintf(stderr, "  -r, --rate HZ      sample rate of the null backend and offline render (default 48000)\n");
+  fprintf(stderr, "  -t, --threads N    audio worker threads for the instrument graph (default: one per extra core)\n");
+  fprintf(stderr, "  -s, --sync         render inside the JACK process callback (no extra period of latency),\n");
+  fprintf(stderr, "                     always on with the null backend\n");
+  fprintf(stderr, "  -e, --export FILE  write the song's tracks to a standard MIDI file and exit\n");
+  fprintf(stderr, "  -B, --bench        time the synth oscillator kernels and exit\n");
+  fprintf(stderr, "  -T, --tuning FILE  Scala scale (.scl) to tune the synths to (default 12-TET, A4 = 440 Hz)\n");
+  fprintf(stderr, "  -K, --keymap FILE  Scala keyboard mapping (.kbm) for the --tuning scale\n");
+  fprintf(stderr, "  -h, --help         show this help\n");
+  fprintf(stderr, "SONG is the song or MIDI file used by --render and --export (default song.mix)\n");
 
   exit(1);
 }
@@ -1269,6 +1289,9 @@ void draw_sequencer(Instrument *inst, bool back, Point off)
     snprintf(tmp, sizeof(tmp), "%3.0f BPM", bpm);
     draw_string(FONT_TINY, off.x + 192, off.y + 30, tmp);
 
+    snprintf(tmp, sizeof(tmp), "Track %d", atomic_load(&sequencer_data.record_track) + 1);
+    draw_string(FONT_TINY, off.x + 10, off.y + 30, tmp);
+
     snprintf(tmp, sizeof(tmp), "%5d.%0.4f",
         ((int)seq_time) / 4, fmod(seq_time, 4.0));
     draw_string_centered(FONT_TINY, off.x + 350, off.y + 0.75 * get_dim(DIM_SEQUENCER_MARGIN_TOP), tmp);
@@ -1323,7 +1346,7 @@ Connection *init_connection(Connection *conn, int index, bool is_input, rect pos
   conn->inst = inst;
   conn->target_inst = NULL;
   conn->target_connection = 0;
-  conn->buffer = NULL;
+  conn->feedback = false;
 }
 
 Slider *init_slider(Slider *slider, const char *name, 
@@ -1347,38 +1370,25 @@ Slider *init_slider(Slider *slider, const char *name,
   slider->inst = inst;
   slider->callback = NULL;
   slider->callback_data = NULL;
-}
-
-Instrument *AllocateInstrument(void)
-{
-  Instrument *inst = (Instrument *)calloc(1, sizeof(Instrument));
 
-  return inst;
+  if (inst)
+    init_param(&inst->params[slider - inst->sliders], value, !discrete);
 }
 
-void save_song(const char *filename)
+/* the audio thread only sees the value through the parameter queue */
+void set_slider_value(Slider *slider, double value)
 {
-  FILE *f = fopen(filename, "wb");
-  if (!f)
-    return;
-
-  Event *events = sequencer_data.track[0].events;
-  for (int i = 0; i < sequencer_data.track[0].event_count; i++)
-  {
-    if (events[i].type = ET_NOTE)
-      fprintf(f, "%d,%f,%d,%d,%f\n", 1, events[i].time_seq, events[i].val1, events[i].val2, events[i].duration);
-  }
+  slider->value = value;
 
-  fclose(f);
+  if (slider->inst)
+    send_param(slider->inst, slider - slider->inst->sliders, value);
 }
 
-void load_song(const char *filename)
+Instrument *AllocateInstrument(void)
 {
-  FILE *f = fopen(filename, "rb");
-  if (!f)
-    return;
+  Instrument *inst = (Instrument *)calloc(1, sizeof(Instrument));
 
-  fclose(f);
+  return inst;
 }
 
 void start_playing()
@@ -1402,6 +1412,65 @@ void update_variable_callback(Slider *s, int type)
   }
 }
 
+/* edits the tempo in effect at the song position */
+void tempo_callback(Slider *s, int type)
+{
+  if (type == 2)
+    set_tempo_at((uint32_t)(seq_time * PPQ), s->value);
+}
+
+/* instruments of the rack a track can play to, in rack order */
+Instrument *track_instruments[64];
+const char *track_instrument_names[ARRAY_SIZE(track_instruments) + 1];
+int track_instrument_count;
+
+/* after the rack or the record track changed, the Instrument slider shows
+ * where the record track plays to */
+void update_track_instrument_slider(void)
+{
+  if (!sequencer)
+    return;
+
+  Slider *s = &sequencer->sliders[SEQUENCER_TRACK_INSTRUMENT];
+  Instrument *current = sequencer_data.track_instrument[atomic_load(&sequencer_data.record_track)];
+
+  if (!current)
+    current = midi_input_instrument;
+
+  track_instrument_count = 0;
+  s->value = 0.0;
+  for (Instrument *inst = the_rack.first; inst && track_instrument_count < ARRAY_SIZE(track_instruments); inst = inst->next)
+  {
+    if (!inst->process_midi)
+      continue;
+
+    if (inst == current)
+      s->value = track_instrument_count;
+    track_instrument_names[track_instrument_count] = inst->user_name;
+    track_instruments[track_instrument_count++] = inst;
+  }
+  track_instrument_names[track_instrument_count] = NULL;
+  s->max = MAX(track_instrument_count - 1, 1); /* a range for the thumb even with one */
+}
+
+void record_track_callback(Slider *s, int type)
+{
+  if (type == 2)
+  {
+    atomic_store(&sequencer_data.record_track, (int)s->value - 1);
+    update_track_instrument_slider();
+  }
+}
+
+/* routes the record track */
+void track_instrument_callback(Slider *s, int type)
+{
+  int i = (int)s->value;
+
+  if (type == 2 && i < track_instrument_count)
+    sequencer_data.track_instrument[atomic_load(&sequencer_data.record_track)] = track_instruments[i];
+}
+
 void button_pressed_callback(Slider *s, int type)
 {
   switch (type)
@@ -1436,10 +1505,12 @@ void button_pressed_callback(Slider *s, int type)
           recording = false;
           sequencer->sliders[TRANSPORT_REC].value = 0.0;
         }
-        seq_time = 0;
+        sequencer_seek(0);
       }
       else if (s == &sequencer->sliders[TRANSPORT_LOAD])
       {
+        if (playing)
+          stop_playing();
         load_song("song.mix");
       }
       else if (s == &sequencer->sliders[TRANSPORT_SAVE])
@@ -1466,9 +1537,7 @@ Instrument *make_synth(void)
   inst->num_inputs = 0;
 
   inst->specific_data = calloc(1, sizeof(struct synth_data));
-  struct synth_data *data = (struct synth_data *)inst->specific_data;
-  for (int i = 0; i < MAX_SYNTH_POLYPHONY; i++)
-    data->note[i] = -1;
+  init_synth_voices((struct synth_data *)inst->specific_data);
 
   inst->num_outputs = 2;
   init_connection(&inst->outputs[0], 0, false, (rect){510, 10, 10, 10}, inst);
@@ -1477,12 +1546,12 @@ Instrument *make_synth(void)
   int osc_gui_width = 60;
   int osc_x_pos = 20;
 
-  static const char *osc_shape_names[] = {"Saw", "Square", "Triangle", "Sine", NULL};
+  static const char *osc_shape_names[] = {"Saw", "Square", "Triangle", "Sine", "BLEP Saw", "BLEP Sqr", "BLEP Tri", NULL};
 
   inst->slider_count = SYNTH_SLIDER_COUNT;
 
-  //init_slider(&inst->sliders[SYNTH_OSC1_SHAPE], "Osc 1 Shape", 0.0, 3.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
-  init_slider(&inst->sliders[SYNTH_OSC1_SHAPE], "Osc 1 Shape", 0.0, 3.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 70}, (Point){10, 10}, SLIDER_STYLE_RADIO_BUTTON, inst);
+  //init_slider(&inst->sliders[SYNTH_OSC1_SHAPE], "Osc 1 Shape", 0.0, 6.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
+  init_slider(&inst->sliders[SYNTH_OSC1_SHAPE], "Osc 1 Shape", 0.0, 6.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 77}, (Point){10, 10}, SLIDER_STYLE_RADIO_BUTTON, inst);
 
   inst->sliders[SYNTH_OSC1_SHAPE].rotary_start = (150.0 / 180.0) * M_PI;
   inst->sliders[SYNTH_OSC1_SHAPE].rotary_range = (120.0 / 180.0) * M_PI;
@@ -1495,7 +1564,7 @@ Instrument *make_synth(void)
 
   osc_x_pos += osc_gui_width + 20;
 
-  init_slider(&inst->sliders[SYNTH_OSC2_SHAPE], "Osc 2 Shape", 0.0, 3.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
+  init_slider(&inst->sliders[SYNTH_OSC2_SHAPE], "Osc 2 Shape", 0.0, 6.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
 
   inst->sliders[SYNTH_OSC2_SHAPE].rotary_start = (150.0 / 180.0) * M_PI;
   inst->sliders[SYNTH_OSC2_SHAPE].rotary_range = (120.0 / 180.0) * M_PI;
@@ -1509,7 +1578,7 @@ Instrument *make_synth(void)
 
   osc_x_pos += osc_gui_width + 20;
 
-  init_slider(&inst->sliders[SYNTH_OSC3_SHAPE], "Osc 3 Shape", 0.0, 3.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
+  init_slider(&inst->sliders[SYNTH_OSC3_SHAPE], "Osc 3 Shape", 0.0, 6.0, 0.0, MAP_LINEAR, 1, osc_shape_names, (rect){osc_x_pos, 50, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
 
   inst->sliders[SYNTH_OSC3_SHAPE].rotary_start = (150.0 / 180.0) * M_PI;
   inst->sliders[SYNTH_OSC3_SHAPE].rotary_range = (120.0 / 180.0) * M_PI;
@@ -1522,8 +1591,26 @@ Instrument *make_synth(void)
   init_slider(&inst->sliders[SYNTH_OSC3_VOLUME_RATIO], "Osc 3 Volume Ratio", 0.0, 1.0, 0.0, MAP_LINEAR, 0, NULL, (rect){osc_x_pos, 270, osc_gui_width, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
 
   init_slider(&inst->sliders[SYNTH_FILTER_CUTOFF], "Filter", 10.0, 20000.0, 5000.0, MAP_EXP, 0, NULL, (rect){300, 30, 80, 80}, (Point){10, 10}, SLIDER_STYLE_ROTARY, inst);
+  init_slider(&inst->sliders[SYNTH_FILTER_RESONANCE], "Resonance", 0.0, 1.0, 0.0, MAP_LINEAR, 0, NULL, (rect){400, 40, 60, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
+  init_slider(&inst->sliders[SYNTH_FILTER_ENV_AMOUNT], "Filter Envelope", -5.0, 5.0, 0.0, MAP_LINEAR, 0, NULL, (rect){400, 80, 60, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
 
   init_slider(&inst->sliders[SYNTH_VOLUME], "Volume", 0.0, 1.0, 0.2, MAP_LINEAR, 0, NULL, (rect){600, 20, 10, 150}, (Point){10, 10}, SLIDER_STYLE_VERTICAL, inst);
+
+  init_slider(&inst->sliders[SYNTH_ATTACK], "Attack", 0.001, 5.0, 0.005, MAP_EXP, 0, NULL, (rect){300, 140, 10, 110}, (Point){10, 10}, SLIDER_STYLE_VERTICAL, inst);
+  init_slider(&inst->sliders[SYNTH_DECAY], "Decay", 0.001, 5.0, 0.2, MAP_EXP, 0, NULL, (rect){330, 140, 10, 110}, (Point){10, 10}, SLIDER_STYLE_VERTICAL, inst);
+  init_slider(&inst->sliders[SYNTH_SUSTAIN], "Sustain", 0.0, 1.0, 0.8, MAP_LINEAR, 0, NULL, (rect){360, 140, 10, 110}, (Point){10, 10}, SLIDER_STYLE_VERTICAL, inst);
+  init_slider(&inst->sliders[SYNTH_RELEASE], "Release", 0.001, 10.0, 0.1, MAP_EXP, 0, NULL, (rect){390, 140, 10, 110}, (Point){10, 10}, SLIDER_STYLE_VERTICAL, inst);
+
+  /* the envelope is only read at note on/off, a ramp there would never advance */
+  inst->params[SYNTH_ATTACK].smooth = false;
+  inst->params[SYNTH_DECAY].smooth = false;
+  inst->params[SYNTH_SUSTAIN].smooth = false;
+  inst->params[SYNTH_RELEASE].smooth = false;
+
+  static const char *voice_steal_names[] = {"Oldest", "Quietest", "Retrigger", NULL};
+
+  init_slider(&inst->sliders[SYNTH_VOICE_STEAL], "Voice Steal", 0.0, 2.0, 0.0, MAP_LINEAR, 1, voice_steal_names, (rect){430, 140, 60, 52}, (Point){10, 10}, SLIDER_STYLE_RADIO_BUTTON, inst);
+  init_slider(&inst->sliders[SYNTH_POLYPHONY], "Polyphony", 1.0, MAX_SYNTH_POLYPHONY, MAX_SYNTH_POLYPHONY, MAP_LINEAR, 1, NULL, (rect){430, 220, 60, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
   return inst;
 }
 
@@ -1543,7 +1630,7 @@ Instrument *make_sequencer(void)
 
   inst->num_outputs = 0;
 
-  inst->slider_count = 6;
+  inst->slider_count = TRANSPORT_SLIDER_COUNT;
   double button_size = get_dim(DIM_TRANSPORT_HEIGHT) - 2 * get_dim(DIM_BUTTON_SPACING);
 
   init_slider(&inst->sliders[TRANSPORT_REC], "Rec", 0, 1.0, 0.0, 0, 0, NULL,
@@ -1568,8 +1655,13 @@ Instrument *make_sequencer(void)
   inst->sliders[TRANSPORT_SAVE].callback = &button_pressed_callback;
 
   init_slider(&inst->sliders[SEQUENCER_BPM], "BPM", 30.0, 180.0, 120.0, 0, 1, NULL, (rect){150, 15, 160, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
-  inst->sliders[SEQUENCER_BPM].callback = &update_variable_callback;
-  inst->sliders[SEQUENCER_BPM].callback_data = (void *)&bpm;
+  inst->sliders[SEQUENCER_BPM].callback = &tempo_callback;
+
+  init_slider(&inst->sliders[SEQUENCER_TRACK], "Track", 1.0, ARRAY_SIZE(sequencer_data.track), 1.0, 0, 1, NULL, (rect){60, 32, 80, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
+  inst->sliders[SEQUENCER_TRACK].callback = &record_track_callback;
+
+  init_slider(&inst->sliders[SEQUENCER_TRACK_INSTRUMENT], "Instrument", 0.0, 1.0, 0.0, 0, 1, track_instrument_names, (rect){230, 32, 80, 10}, (Point){10, 10}, SLIDER_STYLE_HORIZONTAL, inst);
+  inst->sliders[SEQUENCER_TRACK_INSTRUMENT].callback = &track_instrument_callback;
 
   return inst;
 }
@@ -1607,6 +1699,7 @@ Instrument *make_chorus(void)
   inst->height = rack_height_unit(1);
   inst->draw = &draw_instrument;
   inst->process_audio = &process_audio_chorus;
+  inst->specific_data = make_reverb();
 
   inst->background_color = color_main;
 
@@ -1724,6 +1817,11 @@ void init_rack(void)
   sequencer = make_sequencer();
   add_to_rack(sequencer, false);
 
+  /* every track plays to the synth until routed elsewhere */
+  for (int t = 0; t < ARRAY_SIZE(sequencer_data.track); t++)
+    sequencer_data.track_instrument[t] = midi_input_instrument;
+  update_track_instrument_slider();
+
   recalculate_audio_graph();
   recalculate_rack_coordinates();
 }
@@ -2134,7 +2232,7 @@ void mouse_button_func(GLFWwindow *window, int button, int action, int mods)
                 {
                   if (sliders[i].style == SLIDER_STYLE_TOGGLE_SWITCH)
                   {
-                    sliders[i].value = !(int)sliders[i].value;
+                    set_slider_value(&sliders[i], !(int)sliders[i].value);
                   }
                   else if (sliders[i].style == SLIDER_STYLE_TRANSPORT_BUTTON)
                   {
@@ -2148,7 +2246,7 @@ void mouse_button_func(GLFWwindow *window, int button, int action, int mods)
                     int num_choices = (int)(sliders[i].max - sliders[i].min) + 1;
                     int new_value = sliders[i].min + (int)((synth_mpos.y - rslider.y) / (rslider.h / num_choices));
                     if (sliders[i].value != new_value)
-                      sliders[i].value = new_value;
+                      set_slider_value(&sliders[i], new_value);
                   }
                   else
                   {
@@ -2229,7 +2327,7 @@ void mouse_move_func(GLFWwindow *window, double x_d, double y_d)
   {
     double delta = slider_drag->style == SLIDER_STYLE_HORIZONTAL ? mpos.x - mpos_left_down.x : (- mpos.y + mpos_left_down.y);
     double start = slider_value_to_screen_pos(slider_drag, slider_drag->value_start_drag);
-    slider_drag->value = slider_screen_pos_to_value(slider_drag, start + delta);
+    set_slider_value(slider_drag, slider_screen_pos_to_value(slider_drag, start + delta));
     update_instrument(slider_drag->inst);
     char tmp_value[32];
     tmp_value[0] = 0;
@@ -2383,6 +2481,8 @@ void key_func(GLFWwindow *window, int key, int scancode, int action, int mods)
       int newstate = action == GLFW_RELEASE ? 0 : 1;
       int velocity = 64;
       int note = (keyboard_octave + 1) * 12 + keys[i].note;
+      if (note > 127)
+        return;
       if (gui_keyboard_state[note] != newstate)
       {
         midi_user_input(note, newstate, velocity);
@@ -2555,6 +2655,108 @@ void glfw_error_callback(int error, const char* desc)
 
 int main(int argc, char *argv[])
 {
+  const char *render_filename = NULL;
+  double render_length = 10.0;
+  const char *export_filename = NULL;
+  bool bench = false;
+  const char *scale_filename = NULL;
+  const char *keymap_filename = NULL;
+
+  static const struct option long_options[] = {
+    {"render", required_argument, NULL, 'o'},
+    {"length", required_argument, NULL, 'l'},
+    {"backend", required_argument, NULL, 'b'},
+    {"period", required_argument, NULL, 'p'},
+    {"rate", required_argument, NULL, 'r'},
+    {"threads", required_argument, NULL, 't'},
+    {"sync", no_argument, NULL, 's'},
+    {"export", required_argument, NULL, 'e'},
+    {"bench", no_argument, NULL, 'B'},
+    {"tuning", required_argument, NULL, 'T'},
+    {"keymap", required_argument, NULL, 'K'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "o:l:b:p:r:t:se:BT:K:h", long_options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 'o':
+        render_filename = optarg;
+        break;
+      case 'l':
+        render_length = atof(optarg);
+        break;
+      case 'b':
+        audio_backend = find_audio_backend(optarg);
+        if (!audio_backend)
+        {
+          fprintf(stderr, "Unknown audio backend \"%s\"\n", optarg);
+          print_usage(argv[0]);
+        }
+        break;
+      case 'p':
+        null_backend_period = atoi(optarg);
+        break;
+      case 'r':
+        null_backend_rate = atof(optarg);
+        sample_rate = null_backend_rate;
+        break;
+      case 't':
+        audio_worker_count = atoi(optarg);
+        break;
+      case 's':
+        audio_render_in_callback = true;
+        break;
+      case 'e':
+        export_filename = optarg;
+        break;
+      case 'B':
+        bench = true;
+        break;
+      case 'T':
+        scale_filename = optarg;
+        break;
+      case 'K':
+        keymap_filename = optarg;
+        break;
+      case 'h':
+      default:
+        print_usage(argv[0]);
+        break;
+    }
+  }
+
+  const char *song_filename = optind < argc ? argv[optind] : "song.mix";
+
+  if (bench)
+  {
+    bench_oscillators();
+    return EXIT_SUCCESS;
+  }
+
+  if (scale_filename && !load_tuning(scale_filename, keymap_filename))
+    return EXIT_FAILURE;
+
+  if (render_filename || export_filename)
+  {
+    /* headless: no fonts, no window, no JACK */
+    init_rack();
+    load_song(song_filename);
+
+    if (export_filename && !export_midi_file(export_filename))
+    {
+      fprintf(stderr, "Can't write MIDI file \"%s\"\n", export_filename);
+      return EXIT_FAILURE;
+    }
+    if (!render_filename)
+      return EXIT_SUCCESS;
+
+    return render_offline(render_filename, render_length) ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
   keyboard_display_offset = 7 * get_dim(DIM_KEYBOARD_KEY_WHITE_WIDTH);
 
   /* init font */
@@ -2626,6 +2828,8 @@ int main(int argc, char *argv[])
       redisplay_needed = false;
     }
 
+    sequencer_reserve();
+
     glfwWaitEventsTimeout(0.01);
   }
 
@@ -2634,6 +2838,7 @@ int main(int argc, char *argv[])
   glfwTerminate();
 
   deinit_audio();
+  wait_for_song_save();
 
   return 0;
 }
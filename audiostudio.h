@@ -2,6 +2,7 @@
 #define AUDIOSTUDIO_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 
 #define PI_TIMES_2 (2.0 * M_PI)
 
@@ -43,6 +44,17 @@ enum {
   SYNTH_FILTER_CUTOFF,
 
   SYNTH_VOLUME,
+
+  SYNTH_ATTACK,
+  SYNTH_DECAY,
+  SYNTH_SUSTAIN,
+  SYNTH_RELEASE,
+
+  SYNTH_VOICE_STEAL,
+  SYNTH_POLYPHONY,
+
+  SYNTH_FILTER_RESONANCE,
+  SYNTH_FILTER_ENV_AMOUNT,
   SYNTH_SLIDER_COUNT
 };
 
@@ -55,12 +67,15 @@ extern bool playing;
 enum {
   ET_NOTE = 1,
   ET_CC = 2,
+  ET_TEMPO = 3,
 };
 
+#define PPQ 960 /* ticks per beat */
+
+/* 12 bytes, times in ticks */
 typedef struct Event {
-  //double time_s;
-  double time_seq; // in beats
-  double duration;
+  uint32_t tick;
+  uint32_t duration;
 
   uint8_t type;
   uint8_t val1;
@@ -68,13 +83,38 @@ typedef struct Event {
   uint8_t val3;
 } Event;
 
+#define EVENT_CHUNK_SIZE 256 /* power of two */
+
+typedef struct EventChunk {
+  Event events[EVENT_CHUNK_SIZE];
+} EventChunk;
+
+/* Events in fixed size chunks, allocated by the GUI thread ahead of the
+ * audio thread that records into them. */
 typedef struct EventBatch {
-  Event events[10000];
+  _Atomic(EventChunk **) chunks;
+  atomic_int chunk_count;
+  int chunk_capacity; /* size of the chunks table */
+  int mapped_chunks; /* first chunks, not owned, e.g. in the loaded song file */
   int event_count;
+
+  int open_note[128]; /* index + 1 of the note being recorded for each key */
 } EventBatch;
 
+#define MAX_TEMPO_POINTS 256
+
+/* tempo from the tick on */
+typedef struct TempoPoint {
+  uint32_t tick;
+  double bpm;
+} TempoPoint;
+
 typedef struct Sequencer_ {
   EventBatch track[10];
+  TempoPoint tempo[MAX_TEMPO_POINTS]; /* sorted by tick, edited by the GUI */
+  int tempo_count;
+  struct Instrument_ *track_instrument[10]; /* NULL plays to the MIDI input instrument */
+  atomic_int record_track; /* set by the GUI, taken by the audio thread at the next block */
 
   EventBatch recorder;
 
@@ -135,6 +175,24 @@ typedef struct Slider_
   struct Instrument_ *inst;
 } Slider;
 
+/* audio side state of a slider, written by the audio thread only */
+typedef struct Param_
+{
+  double value;
+  double target;
+  double step;
+  int ramp_frames; /* left until target */
+  bool smooth; /* continuous, ramped instead of jumping */
+} Param;
+
+typedef struct MidiEvent_
+{
+  int frame; /* offset in the block */
+  uint8_t key;
+  uint8_t note_on;
+  uint8_t velocity;
+} MidiEvent;
+
 typedef void (* DrawFunction)(struct Instrument_ *, bool, Point);
 typedef void (* MidiProcessFunction)(struct Instrument_ *, int, int, int);
 typedef void (* AudioProcessFunction)(struct Instrument_ *, int, const void **inputs, void **outputs);
@@ -147,17 +205,65 @@ typedef struct Connection_ {
 
   struct Instrument_ *target_inst;
   int target_connection;
-
-  double *buffer;
+  bool feedback; /* input closing a cycle, reads the previous block */
 } Connection;
 
+enum {
+  ENV_IDLE = 0,
+  ENV_ATTACK,
+  ENV_DECAY,
+  ENV_SUSTAIN,
+  ENV_RELEASE
+};
+
+typedef struct envelope_ {
+  int stage;
+  int frames; /* left in the stage */
+  double value;
+  double step; /* attack */
+  double target; /* decay and release */
+  double multiplier;
+  int decay_frames;
+  double sustain;
+} envelope;
+
 #define MAX_SYNTH_POLYPHONY 64
 #define MAX_DETUNE_VOICES 7
 #define NUM_SYNTH_OSC 3
+#define SYNTH_RUN_FRAMES 64 /* frames rendered at a time */
+enum {
+  VOICE_STEAL_OLDEST = 0,
+  VOICE_STEAL_QUIETEST,
+  VOICE_STEAL_RETRIGGER /* a note already sounding takes its voice back */
+};
+
 struct synth_data {
   int note[MAX_SYNTH_POLYPHONY];
   uint32_t phase_delta[MAX_SYNTH_POLYPHONY][NUM_SYNTH_OSC][MAX_DETUNE_VOICES];
   uint32_t phase[MAX_SYNTH_POLYPHONY][NUM_SYNTH_OSC][MAX_DETUNE_VOICES];
+  envelope env[MAX_SYNTH_POLYPHONY];
+  uint32_t started[MAX_SYNTH_POLYPHONY]; /* note-on count when the voice started */
+  uint32_t note_on_count;
+
+  int active[MAX_SYNTH_POLYPHONY]; /* sounding voices, unordered */
+  int active_index[MAX_SYNTH_POLYPHONY]; /* position of a voice in active */
+  int active_count;
+  int free_voices[MAX_SYNTH_POLYPHONY]; /* stack */
+  int free_count;
+  int key_voice[128]; /* voice + 1 last started for the key */
+
+  /* phase_delta of a voice is valid while its serial matches */
+  double pitch_inputs[13]; /* parameters and tuning the increments were computed from */
+  double freq_modifier[NUM_SYNTH_OSC];
+  double unison_ratio[MAX_DETUNE_VOICES];
+  uint32_t pitch_serial;
+  uint32_t voice_pitch_serial[MAX_SYNTH_POLYPHONY];
+  int mip_level[MAX_SYNTH_POLYPHONY][NUM_SYNTH_OSC]; /* wavetable level for the highest unison voice */
+
+  /* state variable filter of each voice, by position in active */
+  double filter_ic1[MAX_SYNTH_POLYPHONY];
+  double filter_ic2[MAX_SYNTH_POLYPHONY];
+  double filter_buffer[SYNTH_RUN_FRAMES][MAX_SYNTH_POLYPHONY]; /* voices of a run, frame by frame */
 };
 
 typedef struct Instrument_
@@ -173,6 +279,10 @@ typedef struct Instrument_
 
   Slider sliders[256];
   int slider_count;
+  Param params[256];
+
+  MidiEvent midi_events[256]; /* events of the current block by frame */
+  int midi_event_count;
 
   Color background_color;
 
@@ -187,6 +297,10 @@ typedef struct Instrument_
 
   void *specific_data;
 
+  /* set by recalculate_audio_graph */
+  int graph_level;
+  int graph_mark;
+  int graph_index;
 } Instrument;
 
 typedef struct Scrollbar_ {
@@ -217,6 +331,14 @@ typedef struct Transport_ {
   int slider_count;
 } Transport;
 
+/* audio device driving the engine, see audio_backend.c */
+typedef struct AudioBackend_ {
+  const char *name;
+  int (*open)(void); /* reports sample rate and buffer size to the engine */
+  int (*start)(void); /* process callbacks start after this */
+  void (*close)(void);
+} AudioBackend;
+
 extern Rack the_rack;
 extern Transport transport;
 extern Instrument *midi_input_instrument;
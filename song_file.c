@@ -0,0 +1,945 @@
+/*
+ * song_file.c
+ *
+ * Song files: the rack, its connections and slider values, the tempo map and
+ * the events of all tracks
+ *
+ * Initial date: 2026-10-16
+ *
+ * Public domain.
+ */
+
+#include <sys/mman.h>
+#include <fcntl.h>
+
+Instrument *make_io_device(void);
+Instrument *make_synth(void);
+Instrument *make_chorus(void);
+Instrument *add_to_rack(Instrument *inst, bool autoconnect);
+void connect_audio(Instrument *inst1, int n_output, Instrument *inst2, int n_input);
+void disconnect_audio(Instrument *inst1, int n_output);
+void recalculate_rack_coordinates(void);
+void set_slider_value(Slider *slider, double value);
+void update_track_instrument_slider(void);
+
+///////////////////////////////////////////////////////////////////////////////
+// Binary format
+///////////////////////////////////////////////////////////////////////////////
+
+/* Native byte order, so the events can be used straight from the mapped
+ * file. Sections follow the header, 8 byte aligned; the events of each track
+ * are 64 byte aligned and padded to whole chunks. */
+
+#define SONG_MAGIC "AMSSONG"
+#define SONG_VERSION 1
+
+typedef struct SongHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint64_t file_size;
+
+  uint32_t instrument_count;
+  uint32_t slider_count;
+  uint32_t connection_count;
+  uint32_t tempo_count;
+  uint32_t track_count;
+  int32_t midi_input_instrument; /* index or -1 */
+  int32_t record_track;
+  uint32_t reserved;
+
+  uint64_t instruments_offset;
+  uint64_t sliders_offset; /* doubles */
+  uint64_t connections_offset;
+  uint64_t tempo_offset;
+  uint64_t tracks_offset;
+} SongHeader;
+
+typedef struct SongInstrument {
+  char name[64]; /* selects the factory */
+  char user_name[64];
+  uint32_t first_slider;
+  uint32_t slider_count;
+} SongInstrument;
+
+typedef struct SongConnection {
+  int32_t from_instrument;
+  int32_t from_output;
+  int32_t to_instrument;
+  int32_t to_input;
+} SongConnection;
+
+typedef struct SongTempo {
+  uint32_t tick;
+  uint32_t reserved;
+  double bpm;
+} SongTempo;
+
+typedef struct SongTrack {
+  uint32_t event_count;
+  int32_t instrument; /* index or -1 */
+  uint64_t events_offset;
+} SongTrack;
+
+static inline uint64_t align_up(uint64_t x, uint64_t alignment)
+{
+  return (x + alignment - 1) & ~(alignment - 1);
+}
+
+int rack_index(Instrument *inst)
+{
+  int i = 0;
+  for (Instrument *it = the_rack.first; it; it = it->next, i++)
+    if (it == inst)
+      return i;
+
+  return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Saving
+///////////////////////////////////////////////////////////////////////////////
+
+/* GUI thread, copies everything the writer needs */
+void *make_song_image(size_t *size)
+{
+  SongHeader h = { .magic = SONG_MAGIC, .version = SONG_VERSION, .header_size = sizeof(SongHeader) };
+
+  for (Instrument *inst = the_rack.first; inst; inst = inst->next)
+  {
+    h.instrument_count++;
+    h.slider_count += inst->slider_count;
+    for (int i = 0; i < inst->num_outputs; i++)
+      if (inst->outputs[i].target_inst)
+        h.connection_count++;
+  }
+  h.tempo_count = sequencer_data.tempo_count;
+  h.track_count = ARRAY_SIZE(sequencer_data.track);
+  h.midi_input_instrument = rack_index(midi_input_instrument);
+  h.record_track = atomic_load(&sequencer_data.record_track);
+
+  /* event counts change while recording, take them once */
+  int event_count[ARRAY_SIZE(sequencer_data.track)];
+  for (int t = 0; t < h.track_count; t++)
+    event_count[t] = sequencer_data.track[t].event_count;
+
+  uint64_t offset = sizeof(SongHeader);
+  h.instruments_offset = offset = align_up(offset, 8);
+  offset += h.instrument_count * sizeof(SongInstrument);
+  h.sliders_offset = offset = align_up(offset, 8);
+  offset += h.slider_count * sizeof(double);
+  h.connections_offset = offset = align_up(offset, 8);
+  offset += h.connection_count * sizeof(SongConnection);
+  h.tempo_offset = offset = align_up(offset, 8);
+  offset += h.tempo_count * sizeof(SongTempo);
+  h.tracks_offset = offset = align_up(offset, 8);
+  offset += h.track_count * sizeof(SongTrack);
+
+  uint64_t events_offset[ARRAY_SIZE(sequencer_data.track)];
+  for (int t = 0; t < h.track_count; t++)
+  {
+    events_offset[t] = offset = align_up(offset, 64);
+    offset += (event_count[t] + EVENT_CHUNK_SIZE - 1) / EVENT_CHUNK_SIZE * sizeof(EventChunk);
+  }
+  h.file_size = offset;
+
+  char *data = calloc(1, h.file_size);
+  if (!data)
+    return NULL;
+
+  memcpy(data, &h, sizeof(h));
+
+  SongInstrument *instruments = (SongInstrument *)(data + h.instruments_offset);
+  double *sliders = (double *)(data + h.sliders_offset);
+  SongConnection *connections = (SongConnection *)(data + h.connections_offset);
+  int n = 0, slider = 0, connection = 0;
+  for (Instrument *inst = the_rack.first; inst; inst = inst->next, n++)
+  {
+    memcpy(instruments[n].name, inst->name, sizeof(inst->name));
+    memcpy(instruments[n].user_name, inst->user_name, sizeof(inst->user_name));
+    instruments[n].first_slider = slider;
+    instruments[n].slider_count = inst->slider_count;
+    for (int i = 0; i < inst->slider_count; i++)
+      sliders[slider++] = inst->sliders[i].value;
+
+    for (int i = 0; i < inst->num_outputs; i++)
+    {
+      Connection *c = &inst->outputs[i];
+      if (c->target_inst)
+        connections[connection++] = (SongConnection){ n, i, rack_index(c->target_inst), c->target_connection };
+    }
+  }
+
+  SongTempo *tempo = (SongTempo *)(data + h.tempo_offset);
+  for (int i = 0; i < h.tempo_count; i++)
+    tempo[i] = (SongTempo){ .tick = sequencer_data.tempo[i].tick, .bpm = sequencer_data.tempo[i].bpm };
+
+  SongTrack *tracks = (SongTrack *)(data + h.tracks_offset);
+  for (int t = 0; t < h.track_count; t++)
+  {
+    tracks[t] = (SongTrack){ event_count[t], rack_index(sequencer_data.track_instrument[t]), events_offset[t] };
+
+    Event *events = (Event *)(data + events_offset[t]);
+    for (int i = 0; i < event_count[t]; i++)
+      events[i] = *event_at(&sequencer_data.track[t], i);
+  }
+
+  *size = h.file_size;
+  return data;
+}
+
+typedef struct SongSave {
+  char filename[256];
+  void *data;
+  size_t size;
+} SongSave;
+
+atomic_bool song_saving;
+
+/* written next to the old file and renamed over it */
+void *save_song_thread(void *arg)
+{
+  SongSave *save = arg;
+  char tmp_filename[300];
+  snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", save->filename);
+
+  FILE *f = fopen(tmp_filename, "wb");
+  bool ok = f && fwrite(save->data, save->size, 1, f) == 1;
+  if (f && fclose(f))
+    ok = false;
+  if (ok && rename(tmp_filename, save->filename))
+    ok = false;
+
+  if (!ok)
+  {
+    fprintf(stderr, "Can't save song to \"%s\"\n", save->filename);
+    unlink(tmp_filename);
+  }
+
+  free(save->data);
+  free(save);
+  atomic_store(&song_saving, false);
+  return NULL;
+}
+
+void wait_for_song_save(void)
+{
+  while (atomic_load(&song_saving))
+    usleep(1000);
+}
+
+void save_song(const char *filename)
+{
+  if (atomic_exchange(&song_saving, true))
+  {
+    fprintf(stderr, "Still saving the previous song\n");
+    return;
+  }
+
+  SongSave *save = calloc(1, sizeof(SongSave));
+  if (save)
+  {
+    snprintf(save->filename, sizeof(save->filename), "%s", filename);
+    save->data = make_song_image(&save->size);
+  }
+
+  pthread_t thread;
+  if (!save || !save->data || pthread_create(&thread, NULL, &save_song_thread, save))
+  {
+    fprintf(stderr, "Can't save song to \"%s\"\n", filename);
+    if (save)
+      free(save->data);
+    free(save);
+    atomic_store(&song_saving, false);
+    return;
+  }
+
+  pthread_detach(thread);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loading
+///////////////////////////////////////////////////////////////////////////////
+
+/* the loaded song file, the tracks use its events in place */
+void *song_mapping;
+size_t song_mapping_size;
+
+Instrument *make_instrument(const char *name)
+{
+  if (!strcmp(name, "Synth"))
+    return make_synth();
+  if (!strcmp(name, "Chorus"))
+    return make_chorus();
+  if (!strcmp(name, "IO Device"))
+    return make_io_device();
+
+  return NULL;
+}
+
+static bool song_section_valid(const SongHeader *h, uint64_t offset, uint64_t count, uint64_t size)
+{
+  return offset % 8 == 0 && offset <= h->file_size && count <= (h->file_size - offset) / size;
+}
+
+bool song_valid(const char *data, size_t size)
+{
+  const SongHeader *h = (const SongHeader *)data;
+
+  if (h->version != SONG_VERSION || h->header_size != sizeof(SongHeader) || h->file_size != size)
+    return false;
+
+  if (!song_section_valid(h, h->instruments_offset, h->instrument_count, sizeof(SongInstrument)) ||
+      !song_section_valid(h, h->sliders_offset, h->slider_count, sizeof(double)) ||
+      !song_section_valid(h, h->connections_offset, h->connection_count, sizeof(SongConnection)) ||
+      !song_section_valid(h, h->tempo_offset, h->tempo_count, sizeof(SongTempo)) ||
+      !song_section_valid(h, h->tracks_offset, h->track_count, sizeof(SongTrack)))
+    return false;
+
+  const SongInstrument *instruments = (const SongInstrument *)(data + h->instruments_offset);
+  for (int i = 0; i < h->instrument_count; i++)
+  {
+    if (instruments[i].first_slider > h->slider_count ||
+        instruments[i].slider_count > h->slider_count - instruments[i].first_slider ||
+        !memchr(instruments[i].name, 0, sizeof(instruments[i].name)) ||
+        !memchr(instruments[i].user_name, 0, sizeof(instruments[i].user_name)))
+      return false;
+  }
+
+  const SongTrack *tracks = (const SongTrack *)(data + h->tracks_offset);
+  for (int t = 0; t < h->track_count; t++)
+  {
+    uint64_t chunks = ((uint64_t)tracks[t].event_count + EVENT_CHUNK_SIZE - 1) / EVENT_CHUNK_SIZE;
+    if (tracks[t].events_offset % 64 || tracks[t].event_count > INT_MAX ||
+        tracks[t].events_offset > size || chunks > (size - tracks[t].events_offset) / sizeof(EventChunk))
+      return false;
+
+    /* played straight from the mapping: keys index tables of 128 and the
+     * cursors and find_event need the events sorted */
+    const Event *events = (const Event *)(data + tracks[t].events_offset);
+    for (uint32_t i = 0; i < tracks[t].event_count; i++)
+    {
+      if (events[i].type == ET_NOTE && (events[i].val1 > 127 || events[i].val2 > 127))
+        return false;
+      if (i > 0 && events[i].tick < events[i - 1].tick)
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/* instruments of the same name are reused in order, missing ones created,
+ * the rack is reordered as saved with the others at the end */
+void load_rack(const char *data)
+{
+  const SongHeader *h = (const SongHeader *)data;
+  const SongInstrument *instruments = (const SongInstrument *)(data + h->instruments_offset);
+  const double *sliders = (const double *)(data + h->sliders_offset);
+
+  int rack_count = 0;
+  for (Instrument *inst = the_rack.first; inst; inst = inst->next)
+    rack_count++;
+
+  Instrument **rack = calloc(rack_count + 1, sizeof(Instrument *));
+  Instrument **loaded = calloc(h->instrument_count + 1, sizeof(Instrument *));
+  if (!rack || !loaded)
+  {
+    free(rack);
+    free(loaded);
+    return;
+  }
+
+  rack_count = 0;
+  for (Instrument *inst = the_rack.first; inst; inst = inst->next)
+  {
+    for (int i = 0; i < inst->num_outputs; i++)
+      disconnect_audio(inst, i);
+    rack[rack_count++] = inst;
+  }
+
+  for (int n = 0; n < h->instrument_count; n++)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "%s", instruments[n].name);
+
+    for (int i = 0; i < rack_count && !loaded[n]; i++)
+    {
+      if (rack[i] && !strcmp(rack[i]->name, name))
+      {
+        loaded[n] = rack[i];
+        rack[i] = NULL;
+      }
+    }
+
+    if (!loaded[n])
+      loaded[n] = make_instrument(name);
+    if (!loaded[n])
+    {
+      fprintf(stderr, "Unknown instrument \"%s\" in song\n", name);
+      continue;
+    }
+
+    Instrument *inst = loaded[n];
+    snprintf(inst->user_name, sizeof(inst->user_name), "%s", instruments[n].user_name);
+
+    for (int i = 0; i < MIN(instruments[n].slider_count, inst->slider_count); i++)
+    {
+      Slider *s = &inst->sliders[i];
+      if (s->style == SLIDER_STYLE_TRANSPORT_BUTTON)
+        continue;
+
+      set_slider_value(s, MIN(MAX(sliders[instruments[n].first_slider + i], s->min), s->max));
+      if (s->callback)
+        s->callback(s, 2);
+    }
+  }
+
+  the_rack.first = NULL;
+  for (int n = 0; n < h->instrument_count; n++)
+  {
+    if (loaded[n])
+    {
+      loaded[n]->prev = loaded[n]->next = NULL;
+      add_to_rack(loaded[n], false);
+    }
+  }
+  for (int i = 0; i < rack_count; i++)
+  {
+    if (rack[i])
+    {
+      rack[i]->prev = rack[i]->next = NULL;
+      add_to_rack(rack[i], false);
+    }
+  }
+
+  const SongConnection *connections = (const SongConnection *)(data + h->connections_offset);
+  for (int i = 0; i < h->connection_count; i++)
+  {
+    const SongConnection *c = &connections[i];
+    if (c->from_instrument < 0 || c->from_instrument >= h->instrument_count ||
+        c->to_instrument < 0 || c->to_instrument >= h->instrument_count)
+      continue;
+
+    Instrument *from = loaded[c->from_instrument];
+    Instrument *to = loaded[c->to_instrument];
+    if (from && to && c->from_output >= 0 && c->from_output < from->num_outputs &&
+        c->to_input >= 0 && c->to_input < to->num_inputs && !to->inputs[c->to_input].target_inst)
+      connect_audio(from, c->from_output, to, c->to_input);
+  }
+
+  if (h->midi_input_instrument >= 0 && h->midi_input_instrument < h->instrument_count &&
+      loaded[h->midi_input_instrument])
+    midi_input_instrument = loaded[h->midi_input_instrument];
+
+  for (int t = 0; t < MIN(h->track_count, ARRAY_SIZE(sequencer_data.track)); t++)
+  {
+    const SongTrack *track = (const SongTrack *)(data + h->tracks_offset) + t;
+    sequencer_data.track_instrument[t] = track->instrument >= 0 && track->instrument < h->instrument_count ?
+      loaded[track->instrument] : NULL;
+  }
+
+  if (h->record_track >= 0 && h->record_track < ARRAY_SIZE(sequencer_data.track))
+    atomic_store(&sequencer_data.record_track, h->record_track);
+
+  free(rack);
+  free(loaded);
+
+  recalculate_audio_graph();
+  recalculate_rack_coordinates();
+  update_track_instrument_slider();
+}
+
+/* Text songs, one event per line. The first sequencer saved
+ * track,beat,key,velocity,duration with times in beats, before the binary
+ * format songs were saved as track,type,tick,key,velocity,duration with
+ * tempo changes as 0,type,tick,bpm. False if no line is either. */
+bool load_song_text(FILE *f)
+{
+  sequencer_data.tempo_count = 0;
+
+  char line[256];
+  int lines = 0, events = 0;
+  while (fgets(line, sizeof(line), f))
+  {
+    int track, type, key, velocity;
+    unsigned int tick, duration;
+    double tempo, beat, beats;
+
+    lines++;
+    if (sscanf(line, "0,%d,%u,%lf", &type, &tick, &tempo) == 3 && type == ET_TEMPO)
+    {
+      add_tempo_point(tick, tempo);
+      events++;
+      continue;
+    }
+
+    /* the times in beats are printed with a decimal point */
+    if (sscanf(line, "%d,%d,%u,%d,%d,%u", &track, &type, &tick, &key, &velocity, &duration) != 6)
+    {
+      if (sscanf(line, "%d,%lf,%d,%d,%lf", &track, &beat, &key, &velocity, &beats) != 5 || beat < 0.0 || beats < 0.0)
+        continue;
+      type = ET_NOTE;
+      tick = (unsigned int)MIN(llround(beat * PPQ), UINT32_MAX);
+      duration = (unsigned int)MIN(MAX(llround(beats * PPQ), 1), UINT32_MAX);
+    }
+    events++;
+    if (track < 1 || track > ARRAY_SIZE(sequencer_data.track) || type != ET_NOTE)
+      continue;
+
+    Event *event = event_batch_append(&sequencer_data.track[track - 1]);
+    if (!event)
+      break;
+
+    *event = (Event){ .tick = tick, .duration = duration, .type = type, .val1 = key & 0x7f, .val2 = velocity & 0x7f };
+  }
+
+  for (int t = 0; t < ARRAY_SIZE(sequencer_data.track); t++)
+    sort_event_batch(&sequencer_data.track[t]);
+
+  return events > 0 || lines == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Standard MIDI files
+///////////////////////////////////////////////////////////////////////////////
+
+/* bounded by the chunk being read, errors stick */
+typedef struct MidiReader {
+  FILE *f;
+  uint32_t left;
+  bool error;
+} MidiReader;
+
+static inline int midi_byte(MidiReader *r)
+{
+  int c = r->left > 0 ? getc(r->f) : EOF;
+  if (c == EOF)
+  {
+    r->error = true;
+    return 0;
+  }
+
+  r->left--;
+  return c;
+}
+
+static uint32_t midi_varlen(MidiReader *r)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    int c = midi_byte(r);
+    value = (value << 7) | (c & 0x7f);
+    if (!(c & 0x80))
+      return value;
+  }
+
+  r->error = true;
+  return value;
+}
+
+static void midi_skip(MidiReader *r, uint32_t n)
+{
+  if (n > r->left || fseek(r->f, n, SEEK_CUR))
+  {
+    r->error = true;
+    return;
+  }
+
+  r->left -= n;
+}
+
+static bool read_be(FILE *f, int n, uint32_t *value)
+{
+  *value = 0;
+  for (int i = 0; i < n; i++)
+  {
+    int c = getc(f);
+    if (c == EOF)
+      return false;
+    *value = (*value << 8) | c;
+  }
+
+  return true;
+}
+
+static void close_midi_note(EventBatch *batch, int key, uint32_t tick)
+{
+  Event *event = event_at(batch, batch->open_note[key] - 1);
+  /* at least a tick, 0 is a note still being recorded and never ends */
+  event->duration = MAX(tick - event->tick, 1);
+  batch->open_note[key] = 0;
+}
+
+/* One pass over a track chunk, appending notes in order. Notes of a type 1
+ * chunk go to one sequencer track, of a type 0 file to a track per channel;
+ * tracks are given out in order of the first note. */
+static bool import_midi_track(MidiReader *r, int division, int channel_mask, int track_map[16], int *track_count)
+{
+  uint64_t time = 0;
+  uint32_t tick = 0;
+  int status = 0;
+
+  while (r->left > 0 && !r->error)
+  {
+    time += midi_varlen(r);
+    tick = (uint32_t)MIN(time * PPQ / division, UINT32_MAX);
+
+    int c = midi_byte(r);
+    int data1 = c;
+
+    if (c == 0xff)
+    {
+      int type = midi_byte(r);
+      uint32_t length = midi_varlen(r);
+      status = 0;
+
+      if (type == 0x51 && length == 3)
+      {
+        uint32_t us = midi_byte(r) << 16;
+        us |= midi_byte(r) << 8;
+        us |= midi_byte(r);
+        if (us > 0)
+          add_tempo_point(tick, 60e6 / us);
+      }
+      else if (type == 0x2f)
+        break;
+      else
+        midi_skip(r, length);
+      continue;
+    }
+    else if (c == 0xf0 || c == 0xf7)
+    {
+      midi_skip(r, midi_varlen(r));
+      status = 0;
+      continue;
+    }
+    else if (c >= 0xf0)
+      return false;
+    else if (c & 0x80)
+    {
+      status = c;
+      data1 = midi_byte(r);
+    }
+    else if (!status)
+      return false;
+    /* else running status, c is the first data byte */
+
+    int kind = status & 0xf0;
+    int data2 = kind == 0xc0 || kind == 0xd0 ? 0 : midi_byte(r);
+
+    if (kind != 0x80 && kind != 0x90)
+      continue;
+
+    int *track = &track_map[status & channel_mask];
+    if (*track < 0)
+    {
+      if (*track_count == ARRAY_SIZE(sequencer_data.track))
+        continue;
+      *track = (*track_count)++;
+    }
+
+    EventBatch *batch = &sequencer_data.track[*track];
+    int key = data1 & 0x7f;
+
+    if (batch->open_note[key])
+      close_midi_note(batch, key, tick);
+
+    if (kind == 0x90 && data2 > 0)
+    {
+      Event *event = event_batch_append(batch);
+      if (!event)
+        return false;
+
+      *event = (Event){ .tick = tick, .type = ET_NOTE, .val1 = key, .val2 = data2 & 0x7f };
+      batch->open_note[key] = batch->event_count;
+    }
+  }
+
+  /* notes still held end with the track */
+  for (int t = 0; t < ARRAY_SIZE(sequencer_data.track); t++)
+    for (int key = 0; key < 128; key++)
+      if (sequencer_data.track[t].open_note[key])
+        close_midi_note(&sequencer_data.track[t], key, tick);
+
+  return !r->error;
+}
+
+/* tracks must be empty */
+bool import_midi_file(FILE *f)
+{
+  uint32_t id, length, format, track_chunks, division;
+
+  if (!read_be(f, 4, &id) || id != 0x4d546864 /* MThd */ || !read_be(f, 4, &length) || length < 6 ||
+      !read_be(f, 2, &format) || !read_be(f, 2, &track_chunks) || !read_be(f, 2, &division) ||
+      fseek(f, length - 6, SEEK_CUR))
+    return false;
+
+  if (format > 1 || division == 0 || division & 0x8000)
+  {
+    fprintf(stderr, "Only MIDI files of type 0 and 1 with ticks per beat are supported\n");
+    return false;
+  }
+
+  sequencer_data.tempo_count = 0;
+
+  int track_map[16];
+  int track_count = 0;
+  for (int i = 0; i < 16; i++)
+    track_map[i] = -1;
+
+  for (int n = 0; n < track_chunks; n++)
+  {
+    if (!read_be(f, 4, &id) || !read_be(f, 4, &length))
+      return false;
+
+    MidiReader r = { f, length, false };
+    if (id != 0x4d54726b /* MTrk */)
+    {
+      midi_skip(&r, length);
+      n--;
+      continue;
+    }
+
+    /* a type 1 chunk starts a new track on its first note */
+    if (format == 1)
+      track_map[0] = -1;
+
+    if (!import_midi_track(&r, division, format == 0 ? 0x0f : 0, track_map, &track_count))
+      return false;
+    midi_skip(&r, r.left);
+  }
+
+  return true;
+}
+
+static void write_be(FILE *f, int n, uint32_t value)
+{
+  for (int i = n - 1; i >= 0; i--)
+    putc((value >> (8 * i)) & 0xff, f);
+}
+
+static void write_varlen(FILE *f, uint32_t value)
+{
+  uint8_t bytes[5];
+  int n = 0;
+  do
+  {
+    bytes[n++] = value & 0x7f;
+    value >>= 7;
+  } while (value);
+
+  while (n > 1)
+    putc(bytes[--n] | 0x80, f);
+  putc(bytes[0], f);
+}
+
+typedef struct MidiMessageOut {
+  uint32_t tick;
+  uint8_t status;
+  uint8_t key;
+  uint8_t velocity;
+} MidiMessageOut;
+
+int compare_midi_messages(const void *a, const void *b)
+{
+  const MidiMessageOut *ma = a;
+  const MidiMessageOut *mb = b;
+
+  /* note-offs first, so a repeated note isn't cut */
+  if (ma->tick != mb->tick)
+    return (ma->tick > mb->tick) - (ma->tick < mb->tick);
+  if ((ma->velocity == 0) != (mb->velocity == 0))
+    return ma->velocity == 0 ? -1 : 1;
+  return ma->key - mb->key;
+}
+
+/* the length is filled in by end_midi_track */
+static long begin_midi_track(FILE *f)
+{
+  write_be(f, 4, 0x4d54726b);
+  write_be(f, 4, 0);
+  return ftell(f);
+}
+
+static void end_midi_track(FILE *f, long start, uint32_t last_tick, uint32_t tick)
+{
+  write_varlen(f, tick - last_tick);
+  write_be(f, 3, 0xff2f00);
+
+  long end = ftell(f);
+  fseek(f, start - 4, SEEK_SET);
+  write_be(f, 4, end - start);
+  fseek(f, end, SEEK_SET);
+}
+
+/* type 1 at PPQ: a tempo track and one track per non-empty sequencer track,
+ * on the channel of its number; the tenth track skips channel 10, which
+ * General MIDI players use for drums */
+bool export_midi_file(const char *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    return false;
+
+  int track_count = 0;
+  for (int t = 0; t < ARRAY_SIZE(sequencer_data.track); t++)
+    track_count += sequencer_data.track[t].event_count > 0;
+
+  write_be(f, 4, 0x4d546864);
+  write_be(f, 4, 6);
+  write_be(f, 2, 1);
+  write_be(f, 2, track_count + 1);
+  write_be(f, 2, PPQ);
+
+  long start = begin_midi_track(f);
+  uint32_t last_tick = 0;
+  for (int i = 0; i < sequencer_data.tempo_count; i++)
+  {
+    TempoPoint *point = &sequencer_data.tempo[i];
+    write_varlen(f, point->tick - last_tick);
+    write_be(f, 3, 0xff5103);
+    write_be(f, 3, (uint32_t)(60e6 / point->bpm + 0.5));
+    last_tick = point->tick;
+  }
+  end_midi_track(f, start, last_tick, last_tick);
+
+  bool ok = true;
+  for (int t = 0; t < ARRAY_SIZE(sequencer_data.track) && ok; t++)
+  {
+    EventBatch *batch = &sequencer_data.track[t];
+    if (batch->event_count == 0)
+      continue;
+
+    MidiMessageOut *messages = malloc(2 * batch->event_count * sizeof(MidiMessageOut));
+    if (!messages)
+    {
+      ok = false;
+      break;
+    }
+
+    int channel = t < 9 ? t : t + 1;
+    int count = 0;
+    for (int i = 0; i < batch->event_count; i++)
+    {
+      Event *event = event_at(batch, i);
+      if (event->type != ET_NOTE)
+        continue;
+
+      messages[count++] = (MidiMessageOut){ event->tick, 0x90 | channel, event->val1, MAX(event->val2, 1) };
+      /* note-on without velocity, keeps the running status; a tick later at
+       * least, so it sorts after its own note-on */
+      messages[count++] = (MidiMessageOut){ event->tick + MAX(event->duration, 1), 0x90 | channel, event->val1, 0 };
+    }
+    qsort(messages, count, sizeof(MidiMessageOut), &compare_midi_messages);
+
+    start = begin_midi_track(f);
+    last_tick = 0;
+    int status = 0;
+    for (int i = 0; i < count; i++)
+    {
+      write_varlen(f, messages[i].tick - last_tick);
+      if (messages[i].status != status)
+        putc(status = messages[i].status, f);
+      putc(messages[i].key, f);
+      putc(messages[i].velocity, f);
+      last_tick = messages[i].tick;
+    }
+    end_midi_track(f, start, last_tick, last_tick);
+
+    free(messages);
+  }
+
+  if (fclose(f))
+    ok = false;
+
+  return ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Loading songs
+///////////////////////////////////////////////////////////////////////////////
+
+/* playback has to be stopped; a song file, a MIDI file or a text song */
+void load_song(const char *filename)
+{
+  wait_for_song_save();
+
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return;
+
+  char magic[8] = { 0 };
+  fread(magic, 1, sizeof(magic), f);
+  rewind(f);
+
+  char *data = NULL;
+  size_t size = 0;
+  if (!memcmp(magic, SONG_MAGIC, sizeof(SONG_MAGIC)))
+  {
+    struct stat st;
+    if (!fstat(fileno(f), &st))
+    {
+      size = st.st_size;
+      /* private and writable, recording into the last chunks copies the pages */
+      data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+      if (data == MAP_FAILED)
+        data = NULL;
+    }
+
+    if (!data || size < sizeof(SongHeader) || !song_valid(data, size))
+    {
+      fprintf(stderr, "Invalid song file \"%s\"\n", filename);
+      if (data)
+        munmap(data, size);
+      fclose(f);
+      return;
+    }
+  }
+
+  /* a block may still be playing the old events or seeking in them */
+  hold_tracks();
+
+  for (int t = 0; t < ARRAY_SIZE(sequencer_data.track); t++)
+    free_event_batch(&sequencer_data.track[t]);
+  if (song_mapping)
+    munmap(song_mapping, song_mapping_size);
+  song_mapping = NULL;
+
+  if (data)
+  {
+    const SongHeader *h = (const SongHeader *)data;
+
+    load_rack(data);
+
+    const SongTempo *tempo = (const SongTempo *)(data + h->tempo_offset);
+    sequencer_data.tempo_count = 0;
+    for (int i = 0; i < h->tempo_count; i++)
+      if (tempo[i].bpm > 0.0)
+        add_tempo_point(tempo[i].tick, tempo[i].bpm);
+
+    const SongTrack *tracks = (const SongTrack *)(data + h->tracks_offset);
+    for (int t = 0; t < MIN(h->track_count, ARRAY_SIZE(sequencer_data.track)); t++)
+    {
+      if (tracks[t].event_count > 0)
+        map_event_batch(&sequencer_data.track[t], (EventChunk *)(data + tracks[t].events_offset), tracks[t].event_count);
+    }
+
+    song_mapping = data;
+    song_mapping_size = size;
+  }
+  else if (!memcmp(magic, "MThd", 4))
+  {
+    if (!import_midi_file(f))
+      fprintf(stderr, "Can't read all of MIDI file \"%s\"\n", filename);
+  }
+  else if (!load_song_text(f))
+    fprintf(stderr, "Unrecognized song file \"%s\"\n", filename);
+
+  fclose(f);
+
+  compile_tempo_map();
+  sequencer_seek(0);
+  release_tracks();
+}